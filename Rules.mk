@@ -28,6 +28,10 @@ ifneq ($(debug),y)
 FLAGS += -DNDEBUG
 endif
 
+ifeq ($(scan_dma),y)
+FLAGS += -DSCAN_DMA=1
+endif
+
 FLAGS += -MMD -MF .$(@F).d
 DEPS = .*.d
 
@@ -0,0 +1,69 @@
+/*
+ * decls.h
+ * 
+ * Host build: Pull in the firmware header files as does inc/decls.h, but
+ * with host intrinsics, and with the peripheral registers used by the
+ * keyboard simulated in ordinary memory.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include "util.h"
+#include "mcu/stm32/common_regs.h"
+#include "mcu/stm32/common.h"
+#include "mcu/at32/f4_regs.h"
+#include "mcu/at32/f4.h"
+#include "intrinsics.h"
+
+/* Simulated peripherals (host/sim.c). Every register access first brings
+ * the simulation up to date, so that writes take effect, and reads sample
+ * the simulated matrix, at the time of the access. */
+extern struct host_regs {
+    struct gpio gpioa, gpiob, gpioc;
+    struct afio afio;
+    struct exti exti;
+    struct dma dma1;
+    struct tim tim3;
+    struct rcc rcc;
+    struct nvic nvic;
+    struct dwt dwt;
+} host_regs;
+void *host_io(volatile void *regs);
+#define gpioa ((volatile struct gpio *)host_io(&host_regs.gpioa))
+#define gpiob ((volatile struct gpio *)host_io(&host_regs.gpiob))
+#define gpioc ((volatile struct gpio *)host_io(&host_regs.gpioc))
+#define afio ((volatile struct afio *)host_io(&host_regs.afio))
+#define exti ((volatile struct exti *)host_io(&host_regs.exti))
+#define dma1 ((volatile struct dma *)host_io(&host_regs.dma1))
+#define tim3 ((volatile struct tim *)host_io(&host_regs.tim3))
+#define rcc ((volatile struct rcc *)host_io(&host_regs.rcc))
+#define nvic ((volatile struct nvic *)host_io(&host_regs.nvic))
+#define dwt ((volatile struct dwt *)host_io(&host_regs.dwt))
+
+#include "board.h"
+#include "time.h"
+#include "timer.h"
+#include "usb.h"
+#include "samisara_vintf.h"
+#include "config.h"
+#include "keyboard.h"
+#include "stats.h"
+#include "telemetry.h"
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,51 @@
+/*
+ * intrinsics.h
+ * 
+ * Host build: Compiler intrinsics in place of those for the ARMv7-M core.
+ * The simulator is single-threaded and takes no interrupts, so interrupt
+ * masking is a no-op.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
+/* Force a compilation error if condition is true */
+#define BUILD_BUG_ON(cond) ({ _Static_assert(!(cond), "!(" #cond ")"); })
+
+#define aligned(x) __attribute__((aligned(x)))
+#define packed __attribute((packed))
+#define always_inline __inline__ __attribute__((always_inline))
+#define noinline __attribute__((noinline))
+
+#define likely(x)     __builtin_expect(!!(x),1)
+#define unlikely(x)   __builtin_expect(!!(x),0)
+
+#define illegal() __builtin_trap()
+
+#define barrier() asm volatile ("" ::: "memory")
+#define cpu_sync() barrier()
+#define cpu_relax() barrier()
+
+#define IRQ_global_disable() barrier()
+#define IRQ_global_enable() barrier()
+
+#define IRQ_global_save(flags) ({ (flags) = 0; barrier(); })
+#define IRQ_global_restore(flags) ({ (void)(flags); barrier(); })
+
+#define IRQ_save(newpri) ({ (void)(newpri); barrier(); (uint8_t)0; })
+#define IRQ_restore(oldpri) ({ (void)(oldpri); barrier(); })
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
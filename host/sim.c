@@ -0,0 +1,784 @@
+/*
+ * sim.c
+ * 
+ * Host build: The keyboard firmware (src/keyboard.c, built unmodified) run
+ * against a simulated key matrix. The simulation is of the peripherals the
+ * firmware drives: Column writes to the GPIO output registers pull down
+ * the rows through pressed keys, and row reads sample the row lines as
+ * they settle. EXTI raises the idle-mode wake interrupts, and TIM3 and
+ * DMA1 run the DMA scan engine. Time is simulated too: It advances to each
+ * event in turn, and by one tick at every time_now(), so that busy-waits
+ * (such as settle-time calibration) complete. The other firmware services
+ * used by the keyboard (timers, the USB endpoint, ...) are provided here.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Matrix layout and pin assignments, as seen by the firmware. */
+#include "scan_tables.h"
+#include "sim.h"
+
+/* The simulator accesses the register file directly: host_io() is the
+ * firmware's view. */
+#undef gpioa
+#undef gpiob
+#undef gpioc
+#undef afio
+#undef exti
+#undef dma1
+#undef tim3
+#undef nvic
+#define gpioa (&host_regs.gpioa)
+#define gpiob (&host_regs.gpiob)
+#define gpioc (&host_regs.gpioc)
+#define afio (&host_regs.afio)
+#define exti (&host_regs.exti)
+#define dma1 (&host_regs.dma1)
+#define tim3 (&host_regs.tim3)
+#define nvic (&host_regs.nvic)
+
+#define KEY_WORDS (NR_KEYS/32)
+#define SPECIAL_MASK (SPECIAL0_MASK | ((uint32_t)SPECIAL1_MASK << 16))
+#define NR_PORTS 3
+#define NR_REPORTS 64
+
+/* Row line transition times. A strobed column pulls the rows down hard,
+ * but they return high only through their pull-up resistors. */
+#define ROW_FALL_NS 100
+#define ROW_RISE_NS 500
+
+/* Interrupt handlers in the firmware. */
+void IRQ_6(void), IRQ_7(void), IRQ_8(void), IRQ_9(void), IRQ_10(void);
+void IRQ_16(void), IRQ_23(void), IRQ_40(void);
+
+/* EXTI interrupts: EXTI0-4, EXTI9_5, EXTI15_10. */
+static const struct exti_irq {
+    uint8_t irq;
+    uint16_t lines;
+    void (*fn)(void);
+} exti_irqs[] = {
+    { 6, 0x0001, IRQ_6 }, { 7, 0x0002, IRQ_7 }, { 8, 0x0004, IRQ_8 },
+    { 9, 0x0008, IRQ_9 }, { 10, 0x0010, IRQ_10 },
+    { 23, 0x03e0, IRQ_23 }, { 40, 0xfc00, IRQ_40 }
+};
+
+/* DMA1 Ch6 interrupt. */
+#define DMA_IRQ_CH 6
+#define DMA_IRQ 16
+
+static struct sim {
+    time_t now;              /* Simulated time */
+    time_t io;               /* Time of the most recent register access */
+    uint32_t work;           /* Work posted to the main loop */
+    struct timer *timers;    /* Pending timers, unordered */
+    uint32_t held[KEY_WORDS]; /* Keys held down, by Amiga keycode */
+    /* GPIO: Pins configured as outputs; and the state of each row line,
+     * which follows its target level after the fall or rise time. */
+    uint16_t output[NR_PORTS];
+    uint16_t cols_pulled;    /* Column pins pulled low through keys */
+    struct {
+        bool_t level, target;
+        time_t since;        /* Time at which the target last changed */
+    } row[NR_ROWS];
+    unsigned int row_fall, row_rise; /* in time ticks */
+    /* EXTI: Line levels as last sampled, and edges pending. */
+    uint16_t exti_level, exti_pending;
+    /* NVIC: Interrupts enabled. */
+    uint32_t nvic_en[2];
+    /* TIM3: Times of the next compare (CC1) and update events. */
+    struct {
+        bool_t on;
+        time_t cc, up, period;
+    } tim;
+    /* DMA1 channels: Transfer count and position in the current cycle. */
+    struct {
+        bool_t on;
+        uint16_t nr, idx;
+    } dma[7];
+    /* Host. */
+    unsigned int poll_ms;    /* Host poll interval */
+    time_t next_poll;
+    uint8_t protocol;
+    /* Keyboard endpoint. */
+    struct {
+        uint8_t buf[SIM_REPORT_MAX];
+        unsigned int len;
+        bool_t busy;         /* Written, not yet polled by the host */
+        time_t done;         /* Time of the most recent host poll */
+    } ep;
+    /* Reports received by the host, not yet collected by sim_report(). */
+    struct {
+        uint8_t buf[SIM_REPORT_MAX];
+        unsigned int len;
+        uint32_t time;
+    } report[NR_REPORTS];
+    uint16_t prod, cons;
+} sim;
+
+/* Firmware state and services. */
+struct host_regs host_regs;
+struct config config;
+unsigned int sysclk_mhz = 144;
+uint8_t ep_tx, ep_telemetry;
+
+static void sim_sync(void);
+
+void *host_io(volatile void *regs)
+{
+    sim_sync();
+    return (void *)regs;
+}
+
+time_t time_now(void)
+{
+    return sim.now++;
+}
+
+void delay_us(unsigned int us)
+{
+    sim.now = time_add(sim.now, time_us(us));
+}
+
+void clock_slow(bool_t slow)
+{
+}
+
+void work_post(unsigned int work)
+{
+    sim.work |= 1u << work;
+}
+
+void stats_add(unsigned int region, uint32_t cycles)
+{
+}
+
+void telemetry_stop(void)
+{
+}
+
+void telemetry_log(uint8_t type, uint8_t id, uint16_t val, time_t time)
+{
+}
+
+void timer_init(struct timer *timer, void (*cb_fn)(void *), void *cb_dat)
+{
+    timer->cb_fn = cb_fn;
+    timer->cb_dat = cb_dat;
+}
+
+void timer_cancel(struct timer *timer)
+{
+    struct timer **pprev;
+
+    for (pprev = &sim.timers; *pprev != NULL; pprev = &(*pprev)->next) {
+        if (*pprev == timer) {
+            *pprev = timer->next;
+            break;
+        }
+    }
+}
+
+void timer_set(struct timer *timer, time_t deadline)
+{
+    timer_cancel(timer);
+    timer->deadline = deadline;
+    timer->next = sim.timers;
+    sim.timers = timer;
+}
+
+bool_t usb_remote_wakeup(void)
+{
+    return TRUE;
+}
+
+bool_t ep_tx_ready(uint8_t ep)
+{
+    return !sim.ep.busy;
+}
+
+time_t ep_tx_time(uint8_t ep)
+{
+    return sim.ep.done;
+}
+
+void usb_write(uint8_t ep, const void *buf, uint32_t len)
+{
+    ASSERT(!sim.ep.busy && (len <= sizeof(sim.ep.buf)));
+    memcpy(sim.ep.buf, buf, len);
+    sim.ep.len = len;
+    sim.ep.busy = TRUE;
+}
+
+uint8_t kbd_led(void)
+{
+    return 0;
+}
+
+uint8_t kbd_protocol(void)
+{
+    return sim.protocol;
+}
+
+/* The host disables report repetition (SET_IDLE 0), as most do. */
+uint8_t kbd_idle_rate(void)
+{
+    return 0;
+}
+
+static bool_t key_held(uint8_t key)
+{
+    return (key != KEY_NONE) && ((sim.held[key/32] >> (key&31)) & 1);
+}
+
+static unsigned int port_idx(volatile struct gpio *gpio)
+{
+    return (gpio == gpioa) ? 0 : (gpio == gpiob) ? 1 : 2;
+}
+
+static volatile struct gpio *port(unsigned int idx)
+{
+    return (idx == 0) ? gpioa : (idx == 1) ? gpiob : gpioc;
+}
+
+/* Pins driven low by the GPIO output register. */
+static uint16_t pins_driven_low(volatile struct gpio *gpio)
+{
+    return sim.output[port_idx(gpio)] & ~gpio->odr;
+}
+
+void gpio_configure_pin(GPIO gpio, unsigned int pin, unsigned int mode)
+{
+    unsigned int idx = port_idx(gpio);
+
+    sim_sync();
+
+    /* Outputs have a non-zero speed setting. */
+    if (mode & 3) {
+        sim.output[idx] |= 1u << pin;
+        gpio->odr = (gpio->odr & ~(1u << pin)) | (((mode >> 4) & 1) << pin);
+    } else {
+        sim.output[idx] &= ~(1u << pin);
+    }
+
+    sim_sync();
+}
+
+/* Without per-key diodes, a line driven low pulls down every line
+ * reachable from it through pressed keys: so a rectangle of three pressed
+ * keys also reads its fourth corner as pressed. Returns the rows pulled
+ * low, and sets sim.cols_pulled. */
+static uint8_t matrix_resolve(void)
+{
+    uint8_t pressed[NR_COLS], rows, prev;
+    uint16_t cols_low = pins_driven_low(gpio_col);
+    unsigned int c, r, pin;
+
+    for (c = 0; c < NR_COLS; c++) {
+        pressed[c] = 0;
+        for (r = 0; r < NR_ROWS; r++)
+            if (key_held(matrix_key[c][r]))
+                pressed[c] |= 1u << r;
+    }
+
+    rows = pins_driven_low(gpio_row) & ROW_MASK;
+    sim.cols_pulled = 0;
+    do {
+        prev = rows;
+        for (c = 0; c < NR_COLS; c++) {
+            pin = __builtin_ctz(col_release_bsrr[c]);
+            if ((cols_low & (1u << pin)) || (pressed[c] & rows)) {
+                rows |= pressed[c];
+                if (pressed[c] & rows)
+                    sim.cols_pulled |= 1u << pin;
+            }
+        }
+    } while (rows != prev);
+
+    return rows;
+}
+
+/* Bring each row line up to date at time @t. */
+static void rows_settle(time_t t)
+{
+    unsigned int r;
+
+    for (r = 0; r < NR_ROWS; r++) {
+        if ((sim.row[r].level != sim.row[r].target)
+            && (time_diff(sim.row[r].since, t)
+                >= (sim.row[r].target ? sim.row_rise : sim.row_fall)))
+            sim.row[r].level = sim.row[r].target;
+    }
+}
+
+/* Re-evaluate the level towards which each row line is moving, following
+ * a change to the column outputs or to the keys held at time @t. */
+static void rows_update(time_t t)
+{
+    uint8_t low;
+    unsigned int r;
+    bool_t target;
+
+    rows_settle(t);
+    low = matrix_resolve();
+    for (r = 0; r < NR_ROWS; r++) {
+        target = !((low >> r) & 1);
+        if (target != sim.row[r].target) {
+            sim.row[r].target = target;
+            sim.row[r].since = t;
+        }
+    }
+}
+
+/* Sample every input pin now, and latch EXTI falling edges. Unconnected
+ * inputs read high. */
+static void inputs_sample(void)
+{
+    const uint32_t exticr[4] = {
+        afio->exticr1, afio->exticr2, afio->exticr3, afio->exticr4 };
+    volatile struct gpio *gpio;
+    uint16_t idr[NR_PORTS], level;
+    unsigned int i, r;
+
+    rows_settle(sim.now);
+
+    for (i = 0; i < NR_PORTS; i++) {
+        gpio = port(i);
+        idr[i] = 0xffff & ~pins_driven_low(gpio);
+        if (gpio == gpio_row)
+            for (r = 0; r < NR_ROWS; r++)
+                if (!sim.row[r].level)
+                    idr[i] &= ~(1u << r);
+        if (gpio == gpio_col)
+            idr[i] &= ~sim.cols_pulled;
+        for (r = 0; r < 32; r++) {
+            if (!((SPECIAL_MASK >> r) & 1))
+                continue;
+            if ((gpio == ((r < 16) ? gpio_special0 : gpio_special1))
+                && key_held(special_key[r]))
+                idr[i] &= ~(1u << (r & 15));
+        }
+        gpio->idr = idr[i];
+    }
+
+    level = 0;
+    for (i = 0; i < 16; i++) {
+        r = (exticr[i/4] >> ((i%4)*4)) & 0xf;
+        if ((r < NR_PORTS) && ((idr[r] >> i) & 1))
+            level |= 1u << i;
+    }
+    sim.exti_pending |= sim.exti_level & ~level & exti->ftsr;
+    sim.exti_level = level;
+}
+
+/* TIM3 counts at SYSCLK/(PSC+1) from zero to ARR. Channel 1 requests DMA1
+ * Ch6 when the count reaches CCR1, and each update event (the count
+ * wrapping to zero) requests DMA1 Ch3. */
+static time_t tim_counts(volatile struct tim *tim, unsigned int n)
+{
+    return (time_t)n * (tim->psc + 1) * TIME_MHZ / SYSCLK_MHZ;
+}
+
+static void tim_start(time_t t)
+{
+    sim.tim.on = TRUE;
+    sim.tim.period = tim_counts(tim3, tim3->arr + 1);
+    sim.tim.cc = time_add(t, tim_counts(tim3, tim3->ccr1));
+    sim.tim.up = time_add(t, sim.tim.period);
+}
+
+/* Apply register writes made by the firmware since its previous register
+ * access, as of the time of that access; then sample the inputs now. */
+static void sim_sync(void)
+{
+    volatile struct gpio *gpio;
+    volatile struct dma_chn *ch;
+    uint32_t clr;
+    unsigned int i;
+
+    /* GPIO: BSRR set bits take priority over its reset bits. */
+    for (i = 0; i < NR_PORTS; i++) {
+        gpio = port(i);
+        gpio->odr &= ~(gpio->brr | (gpio->bsrr >> 16));
+        gpio->odr |= gpio->bsrr & 0xffff;
+        gpio->bsrr = gpio->brr = 0;
+    }
+
+    /* EXTI: Pending bits are cleared by writing 1. */
+    sim.exti_pending &= ~exti->pr;
+    exti->pr = 0;
+
+    /* NVIC: Enables are set and cleared by writing 1. */
+    for (i = 0; i < ARRAY_SIZE(sim.nvic_en); i++) {
+        if (nvic->iser[i] != sim.nvic_en[i])
+            sim.nvic_en[i] |= nvic->iser[i];
+        sim.nvic_en[i] &= ~nvic->icer[i];
+        nvic->iser[i] = sim.nvic_en[i];
+        nvic->icer[i] = 0;
+    }
+
+    /* DMA: Flags are cleared by writing 1. A channel's transfer count is
+     * latched as it is enabled. */
+    for (i = 0; i < ARRAY_SIZE(sim.dma); i++) {
+        clr = dma1->ifcr & (0xfu << (i*4));
+        if (clr & DMA_IFCR_CGIF(i+1))
+            clr = 0xfu << (i*4);
+        dma1->isr &= ~clr;
+        ch = &dma1->ch1 + i;
+        if ((ch->cr & DMA_CR_EN) && !sim.dma[i].on) {
+            sim.dma[i].nr = ch->ndtr;
+            sim.dma[i].idx = 0;
+        }
+        sim.dma[i].on = !!(ch->cr & DMA_CR_EN);
+    }
+    dma1->ifcr = 0;
+
+    /* TIM3 */
+    if ((tim3->cr1 & TIM_CR1_CEN) && !sim.tim.on)
+        tim_start(sim.io);
+    sim.tim.on = !!(tim3->cr1 & TIM_CR1_CEN);
+
+    rows_update(sim.io);
+    inputs_sample();
+    sim.io = sim.now;
+}
+
+static uint32_t mem_read(uint32_t addr, unsigned int size)
+{
+    void *p = (void *)(uintptr_t)addr;
+    return (size == 1) ? *(volatile uint8_t *)p
+        : (size == 2) ? *(volatile uint16_t *)p
+        : *(volatile uint32_t *)p;
+}
+
+static void mem_write(uint32_t addr, unsigned int size, uint32_t x)
+{
+    void *p = (void *)(uintptr_t)addr;
+    if (size == 1)
+        *(volatile uint8_t *)p = x;
+    else if (size == 2)
+        *(volatile uint16_t *)p = x;
+    else
+        *(volatile uint32_t *)p = x;
+}
+
+/* Perform one transfer on DMA1 channel @n. */
+static void dma_request(unsigned int n)
+{
+    volatile struct dma_chn *ch = &dma1->ch1 + (n-1);
+    unsigned int msize = 1u << ((ch->cr >> 10) & 3);
+    unsigned int psize = 1u << ((ch->cr >> 8) & 3);
+    uint32_t mar;
+
+    if (!(ch->cr & DMA_CR_EN) || !ch->ndtr)
+        return;
+
+    mar = ch->mar;
+    if (ch->cr & DMA_CR_MINC)
+        mar += sim.dma[n-1].idx * msize;
+
+    sim_sync();
+    if (ch->cr & DMA_CR_DIR_M2P)
+        mem_write(ch->par, psize, mem_read(mar, msize));
+    else
+        mem_write(mar, msize, mem_read(ch->par, psize));
+    sim_sync();
+
+    sim.dma[n-1].idx++;
+    if (--ch->ndtr == sim.dma[n-1].nr / 2)
+        dma1->isr |= DMA_ISR_HTIF(n) | DMA_ISR_GIF(n);
+    if (ch->ndtr == 0) {
+        dma1->isr |= DMA_ISR_TCIF(n) | DMA_ISR_GIF(n);
+        if (ch->cr & DMA_CR_CIRC) {
+            ch->ndtr = sim.dma[n-1].nr;
+            sim.dma[n-1].idx = 0;
+        }
+    }
+}
+
+static bool_t irq_enabled(unsigned int irq)
+{
+    return (sim.nvic_en[irq>>5] >> (irq&31)) & 1;
+}
+
+/* Take the first interrupt that is pending and enabled. */
+static bool_t irq_dispatch(void)
+{
+    volatile struct dma_chn *ch = &dma1->ch1 + (DMA_IRQ_CH-1);
+    uint32_t pending = sim.exti_pending & exti->imr;
+    uint32_t isr = dma1->isr;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(exti_irqs); i++) {
+        if ((pending & exti_irqs[i].lines) && irq_enabled(exti_irqs[i].irq)) {
+            (*exti_irqs[i].fn)();
+            return TRUE;
+        }
+    }
+
+    if ((((isr & DMA_ISR_HTIF(DMA_IRQ_CH)) && (ch->cr & DMA_CR_HTIE))
+         || ((isr & DMA_ISR_TCIF(DMA_IRQ_CH)) && (ch->cr & DMA_CR_TCIE)))
+        && irq_enabled(DMA_IRQ)) {
+        IRQ_16();
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* The host polls the keyboard endpoint. */
+static void host_poll(void)
+{
+    typeof(sim.report[0]) *r;
+
+    if (!sim.ep.busy)
+        return;
+
+    sim.ep.busy = FALSE;
+    sim.ep.done = sim.now;
+    work_post(WORK_USB);
+
+    if ((uint16_t)(sim.prod - sim.cons) == NR_REPORTS)
+        sim.cons++; /* drop the oldest */
+    r = &sim.report[sim.prod++ & (NR_REPORTS-1)];
+    memcpy(r->buf, sim.ep.buf, sim.ep.len);
+    r->len = sim.ep.len;
+    r->time = sim.now / TIME_MHZ;
+}
+
+static bool_t due(time_t t)
+{
+    return time_diff(t, sim.now) >= 0;
+}
+
+/* Run the earliest event which is due, if any. */
+static bool_t event_run(void)
+{
+    struct timer *t, *first = NULL;
+
+    if (sim.tim.on && due(sim.tim.cc)
+        && (time_diff(sim.tim.cc, sim.tim.up) >= 0)) {
+        sim.tim.cc = time_add(sim.tim.cc, sim.tim.period);
+        if (tim3->dier & TIM_DIER_CC1DE)
+            dma_request(6);
+        return TRUE;
+    }
+
+    if (sim.tim.on && due(sim.tim.up)) {
+        sim.tim.up = time_add(sim.tim.up, sim.tim.period);
+        if (tim3->dier & TIM_DIER_UDE)
+            dma_request(3);
+        return TRUE;
+    }
+
+    if (due(sim.next_poll)) {
+        sim.next_poll = time_add(sim.next_poll, time_ms(sim.poll_ms));
+        host_poll();
+        return TRUE;
+    }
+
+    for (t = sim.timers; t != NULL; t = t->next) {
+        if (due(t->deadline)
+            && (!first || (time_diff(t->deadline, first->deadline) > 0)))
+            first = t;
+    }
+    if (first != NULL) {
+        timer_cancel(first);
+        (*first->cb_fn)(first->cb_dat);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void event_at(time_t *p_next, time_t t)
+{
+    if (time_diff(t, *p_next) > 0)
+        *p_next = t;
+}
+
+/* Time of the next event, or @until if that is sooner. */
+static time_t event_next(time_t until)
+{
+    struct timer *t;
+    time_t next = until;
+    unsigned int r;
+
+    if (sim.tim.on) {
+        event_at(&next, sim.tim.cc);
+        event_at(&next, sim.tim.up);
+    }
+    event_at(&next, sim.next_poll);
+    for (t = sim.timers; t != NULL; t = t->next)
+        event_at(&next, t->deadline);
+    for (r = 0; r < NR_ROWS; r++)
+        if (sim.row[r].level != sim.row[r].target)
+            event_at(&next, time_add(sim.row[r].since, sim.row[r].target
+                                     ? sim.row_rise : sim.row_fall));
+
+    return next;
+}
+
+void sim_init(void)
+{
+    unsigned int r;
+
+    /* DMA addresses are 32 bits wide. */
+    if ((uintptr_t)&host_regs != (uint32_t)(uintptr_t)&host_regs)
+        illegal();
+
+    sim.row_fall = (ROW_FALL_NS * TIME_MHZ + 999) / 1000;
+    sim.row_rise = (ROW_RISE_NS * TIME_MHZ + 999) / 1000;
+    for (r = 0; r < NR_ROWS; r++)
+        sim.row[r].level = sim.row[r].target = TRUE;
+    sim.exti_level = 0xffff;
+
+    sim.poll_ms = 1;
+    sim.next_poll = time_ms(1);
+    sim.protocol = KBD_PROTOCOL_REPORT;
+
+    keyboard_default_keymap(&config);
+    keyboard_init();
+    usb_class_ops.configure();
+}
+
+int sim_key(uint8_t key, int pressed)
+{
+    unsigned int c, r, i;
+    bool_t wired = FALSE;
+
+    if (key >= NR_KEYS)
+        return 0;
+
+    for (c = 0; c < NR_COLS; c++)
+        for (r = 0; r < NR_ROWS; r++)
+            if (matrix_key[c][r] == key)
+                wired = TRUE;
+    for (i = 0; i < 32; i++)
+        if (((SPECIAL_MASK >> i) & 1) && (special_key[i] == key))
+            wired = TRUE;
+    if (!wired)
+        return 0;
+
+    sim_sync();
+    if (pressed)
+        sim.held[key/32] |= 1u << (key&31);
+    else
+        sim.held[key/32] &= ~(1u << (key&31));
+    rows_update(sim.now);
+    inputs_sample();
+    return 1;
+}
+
+/* The main loop: Take interrupts and run posted work, else advance time to
+ * the next event. */
+void sim_run(uint32_t us)
+{
+    time_t until = time_us(us), next;
+
+    for (;;) {
+        sim_sync();
+        if (irq_dispatch())
+            continue;
+        if (sim.work) {
+            sim.work = 0;
+            keyboard_process();
+            continue;
+        }
+        if (event_run())
+            continue;
+        next = event_next(until);
+        if (time_diff(sim.now, next) <= 0)
+            break;
+        sim.now = next;
+    }
+}
+
+uint32_t sim_now(void)
+{
+    return sim.now / TIME_MHZ;
+}
+
+void sim_set_poll(unsigned int ms)
+{
+    sim.poll_ms = ms ? ms : 1;
+}
+
+void sim_set_protocol(int boot)
+{
+    sim.protocol = boot ? KBD_PROTOCOL_BOOT : KBD_PROTOCOL_REPORT;
+}
+
+int sim_set_debounce(uint8_t mode, uint8_t ms)
+{
+    struct samisara_cmd_debounce conf;
+
+    keyboard_get_debounce(&conf);
+    conf.mode = mode;
+    if (mode == SAMISARA_DEBOUNCE_EAGER)
+        conf.eager_ms = ms;
+    else
+        conf.deferred_ms = ms;
+    return keyboard_set_debounce(&conf);
+}
+
+void sim_set_idle(uint16_t ms)
+{
+    keyboard_set_idle_timeout(ms);
+}
+
+uint32_t sim_wakeups(void)
+{
+    struct samisara_subreport_idle idle;
+
+    keyboard_get_idle(&idle);
+    return idle.nr_wakeups;
+}
+
+void sim_set_rows(uint32_t fall_ns, uint32_t rise_ns)
+{
+    sim_sync();
+    sim.row_fall = (fall_ns * TIME_MHZ + 999) / 1000;
+    sim.row_rise = (rise_ns * TIME_MHZ + 999) / 1000;
+}
+
+void sim_calibrate(void)
+{
+    keyboard_calibrate();
+}
+
+unsigned int sim_report(uint8_t *buf, uint32_t *p_us)
+{
+    typeof(sim.report[0]) *r;
+
+    if (sim.cons == sim.prod)
+        return 0;
+
+    r = &sim.report[sim.cons++ & (NR_REPORTS-1)];
+    memcpy(buf, r->buf, r->len);
+    *p_us = r->time;
+    return r->len;
+}
+
+unsigned int sim_latency(uint32_t *p50, uint32_t *p99, uint32_t *max)
+{
+    struct samisara_subreport_latency l;
+
+    keyboard_get_latency(&l);
+    *p50 = l.stage[2].p50_us;
+    *p99 = l.stage[2].p99_us;
+    *max = l.stage[2].max_us;
+    return l.nr_samples;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,64 @@
+/*
+ * sim.h
+ * 
+ * Host build: Interface between the trace runner and the simulated
+ * keyboard. Only fixed-width types cross this interface, as the two sides
+ * are built against different headers (the C library and the firmware).
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Initialise the keyboard, as at power-on, and configure it for the host. */
+void sim_init(void);
+
+/* Hold down or let go of a key, by Amiga keycode. Returns 0 if the key is
+ * not wired to the matrix or to a special-key pin. */
+int sim_key(uint8_t key, int pressed);
+
+/* Advance simulated time to @us microseconds: Run the firmware, which
+ * scans the matrix, and let the host poll the keyboard endpoint at each
+ * poll interval. */
+void sim_run(uint32_t us);
+uint32_t sim_now(void);
+
+/* Host poll interval, in milliseconds. */
+void sim_set_poll(unsigned int ms);
+
+/* Protocol selected by the host: Non-zero for the Boot Protocol. */
+void sim_set_protocol(int boot);
+
+/* Debounce configuration: @mode is as SAMISARA_DEBOUNCE_* (0: None,
+ * 1: Eager, 2: Deferred). Returns 0 if invalid. */
+int sim_set_debounce(uint8_t mode, uint8_t ms);
+
+/* Idle-mode timeout, in milliseconds (0: never enter idle mode); and the
+ * number of times the keyboard has woken from idle mode. */
+void sim_set_idle(uint16_t ms);
+uint32_t sim_wakeups(void);
+
+/* Row line fall and rise times, in nanoseconds; and recalibrate the
+ * firmware's settle times to suit. */
+void sim_set_rows(uint32_t fall_ns, uint32_t rise_ns);
+void sim_calibrate(void);
+
+/* Collect the oldest report received by the host, and the time at which it
+ * was received. Returns its length, or 0 if there is none. */
+#define SIM_REPORT_MAX 32
+unsigned int sim_report(uint8_t *buf, uint32_t *p_us);
+
+/* Keypress latency as measured by the firmware: p50, p99 and maximum
+ * totals, in microseconds. Returns the number of samples. */
+unsigned int sim_latency(uint32_t *p50, uint32_t *p99, uint32_t *max);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
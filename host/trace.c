@@ -0,0 +1,245 @@
+/*
+ * trace.c
+ * 
+ * Host build: Replay a scripted key trace against the simulated keyboard,
+ * and check the reports received by the host.
+ * 
+ * A trace is a sequence of lines, run in order. '#' starts a comment.
+ *  poll <ms>                          Host poll interval (default 1)
+ *  protocol boot|report               Protocol selected by the host
+ *  debounce none|eager|deferred <ms>  Debounce configuration
+ *  idle <ms>                          Idle-mode timeout (0: never)
+ *  wakeups <n>                        Times woken from idle mode so far
+ *  rows <fall_ns> <rise_ns>           Row line fall and rise times
+ *  calibrate                          Recalibrate the settle times
+ *  wait <ms>                          Run until time <ms>
+ *  <ms> press <key>...                Keys pressed at time <ms>, by Amiga
+ *  <ms> release <key>...              keycode in hex. <ms> may be a
+ *                                     fraction.
+ *  report [<byte>...]                 The next report received by the
+ *                                     host, in hex. Omitted trailing bytes
+ *                                     must be zero.
+ * Every report received by the host must be matched by a report line.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+/* Time allowed for an expected report to arrive, and for unexpected
+ * reports to arrive at the end of the trace. */
+#define REPORT_TIMEOUT_US 100000
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Debounce modes, indexed by SAMISARA_DEBOUNCE_*. */
+static const char *const debounce_modes[] = { "none", "eager", "deferred" };
+
+static const char *trace_name;
+static unsigned int line_nr;
+static int failed;
+
+/* Time of the first key action not yet seen in a report. */
+static uint32_t action_us;
+static int action_pending;
+
+static void fail(const char *msg)
+{
+    fflush(stdout);
+    fprintf(stderr, "%s:%u: %s\n", trace_name, line_nr, msg);
+    failed = 1;
+}
+
+static void print_report(const char *prefix, const uint8_t *buf,
+                         unsigned int len, uint32_t us)
+{
+    unsigned int i;
+
+    printf("%s%4u.%03u ms:", prefix, us / 1000, us % 1000);
+    for (i = 0; i < len; i++)
+        printf(" %02x", buf[i]);
+    if (action_pending && ((int32_t)(us - action_us) >= 0)) {
+        printf("  (+%u.%03u ms)", (us - action_us) / 1000,
+               (us - action_us) % 1000);
+        action_pending = 0;
+    }
+    printf("\n");
+}
+
+static void key_action(uint32_t us, int pressed, char **tok, int nr)
+{
+    unsigned long key;
+    char *end;
+    int i;
+
+    if ((int32_t)(us - sim_now()) < 0) {
+        fail("time goes backwards");
+        return;
+    }
+    sim_run(us);
+
+    for (i = 0; i < nr; i++) {
+        key = strtoul(tok[i], &end, 16);
+        if (*end || (key > 0xff) || !sim_key(key, pressed))
+            fail("bad key");
+    }
+
+    if (!action_pending) {
+        action_us = us;
+        action_pending = 1;
+    }
+}
+
+static void expect_report(char **tok, int nr)
+{
+    uint8_t buf[SIM_REPORT_MAX];
+    unsigned int len, i;
+    uint32_t us, start = sim_now();
+    unsigned long x;
+    char *end;
+
+    while (!(len = sim_report(buf, &us))) {
+        if ((sim_now() - start) >= REPORT_TIMEOUT_US) {
+            fail("expected report not received");
+            return;
+        }
+        sim_run(sim_now() + 1000);
+    }
+
+    print_report("  ", buf, len, us);
+
+    if (nr > len) {
+        fail("report too short");
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        x = 0;
+        if (i < nr) {
+            x = strtoul(tok[i], &end, 16);
+            if (*end || (x > 0xff)) {
+                fail("bad report byte");
+                return;
+            }
+        }
+        if (buf[i] != x) {
+            fail("report mismatch");
+            return;
+        }
+    }
+}
+
+static void run_line(char *line)
+{
+    char *tok[64], *p, *end;
+    uint32_t us;
+    unsigned int i;
+    int nr = 0;
+
+    if ((p = strchr(line, '#')) != NULL)
+        *p = '\0';
+    for (p = strtok(line, " \t\r\n"); p && (nr < 64);
+         p = strtok(NULL, " \t\r\n"))
+        tok[nr++] = p;
+    if (nr == 0)
+        return;
+
+    if (!strcmp(tok[0], "poll") && (nr == 2)) {
+        sim_set_poll(strtoul(tok[1], NULL, 10));
+    } else if (!strcmp(tok[0], "protocol") && (nr == 2)
+               && (!strcmp(tok[1], "boot") || !strcmp(tok[1], "report"))) {
+        sim_set_protocol(!strcmp(tok[1], "boot"));
+    } else if (!strcmp(tok[0], "debounce") && (nr == 3)) {
+        for (i = 0; i < ARRAY_SIZE(debounce_modes); i++)
+            if (!strcmp(tok[1], debounce_modes[i]))
+                break;
+        if ((i == ARRAY_SIZE(debounce_modes))
+            || !sim_set_debounce(i, strtoul(tok[2], NULL, 10)))
+            fail("bad debounce configuration");
+    } else if (!strcmp(tok[0], "idle") && (nr == 2)) {
+        sim_set_idle(strtoul(tok[1], NULL, 10));
+    } else if (!strcmp(tok[0], "wakeups") && (nr == 2)) {
+        if (sim_wakeups() != strtoul(tok[1], NULL, 10))
+            fail("wakeups mismatch");
+    } else if (!strcmp(tok[0], "rows") && (nr == 3)) {
+        sim_set_rows(strtoul(tok[1], NULL, 10), strtoul(tok[2], NULL, 10));
+    } else if (!strcmp(tok[0], "calibrate") && (nr == 1)) {
+        sim_calibrate();
+    } else if (!strcmp(tok[0], "wait") && (nr == 2)) {
+        us = (uint32_t)(strtod(tok[1], &end) * 1000 + 0.5);
+        if (*end || ((int32_t)(us - sim_now()) < 0))
+            fail("bad time");
+        else
+            sim_run(us);
+    } else if (!strcmp(tok[0], "report")) {
+        expect_report(&tok[1], nr-1);
+    } else if ((nr >= 3) && (!strcmp(tok[1], "press")
+                             || !strcmp(tok[1], "release"))) {
+        us = (uint32_t)(strtod(tok[0], &end) * 1000 + 0.5);
+        if (*end)
+            fail("bad time");
+        else
+            key_action(us, !strcmp(tok[1], "press"), &tok[2], nr-2);
+    } else {
+        fail("syntax error");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char line[256];
+    uint8_t buf[SIM_REPORT_MAX];
+    uint32_t us, p50, p99, max;
+    unsigned int len, nr;
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+        return 2;
+    }
+
+    trace_name = argv[1];
+    if ((f = fopen(trace_name, "r")) == NULL) {
+        perror(trace_name);
+        return 2;
+    }
+
+    printf("%s:\n", trace_name);
+    sim_init();
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_nr++;
+        run_line(line);
+    }
+    fclose(f);
+
+    /* Any further reports were not expected. */
+    sim_run(sim_now() + REPORT_TIMEOUT_US);
+    while ((len = sim_report(buf, &us)) != 0) {
+        print_report("  ", buf, len, us);
+        fail("unexpected report");
+    }
+
+    nr = sim_latency(&p50, &p99, &max);
+    printf("  Latency (%u events): p50 %u us, p99 %u us, max %u us\n",
+           nr, p50, p99, max);
+    printf("%s: %s\n", trace_name, failed ? "FAIL" : "PASS");
+
+    return failed;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,39 @@
+/*
+ * config.h
+ * 
+ * Persistent configuration, saved in flash.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* New fields are appended: a configuration saved by older firmware leaves
+ * them at their defaults. */
+struct config {
+    uint8_t keymap[SAMISARA_KEYMAP_LAYERS][SAMISARA_KEYMAP_KEYS];
+    struct samisara_macro_step macro[SAMISARA_NR_MACROS][SAMISARA_MACRO_STEPS];
+    uint8_t poll_ms; /* Keyboard endpoint bInterval */
+    uint8_t pad_mbz;
+};
+
+/* The working copy. Changes take effect immediately, and persist once
+ * saved. */
+extern struct config config;
+
+/* Load the saved configuration, or the defaults if there is none. */
+void config_init(void);
+void config_save(void);
+/* Restore the defaults of the specified sections (SAMISARA_CONFIG_*). */
+void config_reset(uint8_t sections);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
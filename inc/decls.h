@@ -32,6 +32,10 @@
 #include "timer.h"
 #include "usb.h"
 #include "samisara_vintf.h"
+#include "config.h"
+#include "keyboard.h"
+#include "stats.h"
+#include "telemetry.h"
 
 /*
  * Local variables:
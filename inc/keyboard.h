@@ -0,0 +1,59 @@
+/*
+ * keyboard.h
+ * 
+ * A600/A1200 keyboard matrix scanning.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+void keyboard_init(void);
+void keyboard_process(void);
+uint8_t kbd_led(void);
+
+/* HID protocol selected by the host (SET_PROTOCOL). */
+#define KBD_PROTOCOL_BOOT   0
+#define KBD_PROTOCOL_REPORT 1
+uint8_t kbd_protocol(void);
+
+/* HID idle rate selected by the host (SET_IDLE), in units of 4ms. While
+ * non-zero, an unchanged report is repeated at this interval. */
+uint8_t kbd_idle_rate(void);
+
+/* Measure the settle time of each matrix column, and apply the results to
+ * the scan engine. Scanning is paused for the duration. */
+void keyboard_calibrate(void);
+void keyboard_get_settle(struct samisara_subreport_settle *settle);
+
+/* Key debounce configuration. Returns FALSE if @conf is invalid. */
+bool_t keyboard_set_debounce(const struct samisara_cmd_debounce *conf);
+void keyboard_get_debounce(struct samisara_cmd_debounce *conf);
+
+/* Idle mode. While idle the matrix is not scanned: a keypress resumes
+ * scanning via an EXTI interrupt. */
+void keyboard_set_idle_timeout(uint16_t timeout_ms);
+void keyboard_get_idle(struct samisara_subreport_idle *idle);
+
+void keyboard_get_ghost(struct samisara_subreport_ghost *ghost);
+
+void keyboard_get_events(struct samisara_subreport_events *events);
+
+void keyboard_get_latency(struct samisara_subreport_latency *latency);
+void keyboard_reset_latency(void);
+
+/* Keymap remapping. The keymap itself is held in the configuration. */
+void keyboard_default_keymap(struct config *c);
+bool_t keyboard_set_keymap(const struct samisara_cmd_keymap *cmd);
+bool_t keyboard_set_macro(const struct samisara_cmd_macro *cmd);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -14,6 +14,8 @@
 #define SCB volatile struct scb * const
 #define NVIC volatile struct nvic * const
 #define DBG volatile struct dbg * const
+#define CDBG volatile struct cdbg * const
+#define DWT volatile struct dwt * const
 #define FLASH volatile struct flash * const
 #define PWR volatile struct pwr * const
 #define RCC volatile struct rcc * const
@@ -42,6 +44,11 @@ void system_reset(void);
 #define sysclk_ms(x) ((x) * SYSCLK_MHZ * 1000)
 #define sysclk_stk(x) ((x) * (SYSCLK_MHZ / STK_MHZ))
 
+/* Run the core and buses at SYSCLK/8, or at full speed. The time base and
+ * timer deadlines are unaffected, but other hardware timers run eight times
+ * slower. */
+void clock_slow(bool_t slow);
+
 /* SysTick Timer */
 #define STK_MHZ    (SYSCLK_MHZ / 8)
 void delay_ticks(unsigned int ticks);
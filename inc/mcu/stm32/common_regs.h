@@ -45,6 +45,10 @@ struct scb {
     uint32_t bfar;     /* 38: Bus fault address */
 };
 
+#define SCB_SCR_SEVONPEND      (1u<< 4)
+#define SCB_SCR_SLEEPDEEP      (1u<< 2)
+#define SCB_SCR_SLEEPONEXIT    (1u<< 1)
+
 #define SCB_CCR_BP             (1u<<18)
 #define SCB_CCR_IC             (1u<<17)
 #define SCB_CCR_DC             (1u<<16)
@@ -93,6 +97,34 @@ struct scb {
 
 #define SCB_BASE 0xe000ed00
 
+/* Core debug */
+struct cdbg {
+    uint32_t dhcsr;    /* 00: Debug halting control and status */
+    uint32_t dcrsr;    /* 04: Debug core register selector */
+    uint32_t dcrdr;    /* 08: Debug core register data */
+    uint32_t demcr;    /* 0C: Debug exception and monitor control */
+};
+
+#define CDBG_DEMCR_TRCENA      (1u<<24)
+
+#define CDBG_BASE 0xe000edf0
+
+/* Data watchpoint and trace */
+struct dwt {
+    uint32_t ctrl;     /* 00: Control */
+    uint32_t cyccnt;   /* 04: Cycle count */
+    uint32_t cpicnt;   /* 08: CPI count */
+    uint32_t exccnt;   /* 0C: Exception overhead count */
+    uint32_t sleepcnt; /* 10: Sleep count */
+    uint32_t lsucnt;   /* 14: LSU count */
+    uint32_t foldcnt;  /* 18: Folded-instruction count */
+    uint32_t pcsr;     /* 1C: Program counter sample */
+};
+
+#define DWT_CTRL_CYCCNTENA     (1u<< 0)
+
+#define DWT_BASE 0xe0001000
+
 /* Nested vectored interrupt controller */
 struct nvic {
     uint32_t iser[32]; /*  00: Interrupt set-enable */
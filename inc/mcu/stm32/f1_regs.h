@@ -113,6 +113,8 @@ struct rcc {
 #define RCC_CFGR_PLLSRC_PREDIV1 (1u<<16)
 #define RCC_CFGR_ADCPRE_DIV8 (3u<<14)
 #define RCC_CFGR_PPRE1_DIV2  (4u<<8)
+#define RCC_CFGR_HPRE_DIV8   (0xau<<4)
+#define RCC_CFGR_HPRE_MASK   (0xfu<<4)
 #define RCC_CFGR_SWS_HSI     (0u<<2)
 #define RCC_CFGR_SWS_HSE     (1u<<2)
 #define RCC_CFGR_SWS_PLL     (2u<<2)
@@ -25,10 +25,13 @@
  *  uint8_t pad_mbz[];
  */
 
-/* Which subreport is reported by GetFeatureReport. */
+/* Which subreport is reported by GetFeatureReport. The meaning of @arg,
+ * if any, is specific to the subreport. It may be omitted, in which case it
+ * is zero. */
 #define SAMISARA_CMD_SUBREPORT          0
 struct packed samisara_cmd_subreport {
     uint16_t idx;
+    uint16_t arg;
 };
 
 /* Reset into DFU mode. */
@@ -37,7 +40,109 @@ struct packed samisara_cmd_dfu {
     uint32_t deadbeef;
 };
 
-#define SAMISARA_CMD_MAX                1
+/* Measure matrix column settle times. No parameters. No keys need be held
+ * down: each column is measured no less than the row pull-up rise time. */
+#define SAMISARA_CMD_CALIBRATE          2
+
+/* Select the key debounce algorithm and its time constants.
+ * EAGER: Report the first edge of a key, then ignore it for eager_ms.
+ * DEFERRED: Report a key state only once stable for deferred_ms. */
+#define SAMISARA_CMD_DEBOUNCE           3
+struct packed samisara_cmd_debounce {
+    uint8_t mode; /* SAMISARA_DEBOUNCE_* */
+    uint8_t eager_ms;
+    uint8_t deferred_ms;
+};
+#define SAMISARA_DEBOUNCE_NONE          0
+#define SAMISARA_DEBOUNCE_EAGER         1
+#define SAMISARA_DEBOUNCE_DEFERRED      2
+
+/* Stop scanning, and wait for a keypress at low power, once the matrix has
+ * been empty for timeout_ms. 0 = Never. */
+#define SAMISARA_CMD_IDLE               4
+struct packed samisara_cmd_idle {
+    uint16_t timeout_ms;
+};
+
+/* Reset all cycle-count and latency statistics. No parameters. */
+#define SAMISARA_CMD_STATS_RESET        5
+
+/* Remap keys nr entries of a keymap layer, starting at Amiga keycode
+ * first. Changes take effect immediately, but are lost at reset unless
+ * saved by SAMISARA_CMD_CONFIG_SAVE. */
+#define SAMISARA_CMD_KEYMAP             6
+struct packed samisara_cmd_keymap {
+    uint8_t layer;
+    uint8_t first;
+    uint8_t nr;
+    uint8_t usage[40]; /* Command length covers only the first nr */
+};
+
+/* Save the current configuration to flash. No parameters. */
+#define SAMISARA_CMD_CONFIG_SAVE        7
+
+/* Restore the default configuration of the specified sections, or of all
+ * sections if there are no parameters. It is not saved to flash. A change
+ * to the poll interval re-enumerates the device. */
+#define SAMISARA_CMD_CONFIG_RESET       8
+struct packed samisara_cmd_config_reset {
+    uint8_t sections; /* SAMISARA_CONFIG_* */
+};
+#define SAMISARA_CONFIG_KEYMAP          (1u<<0)
+#define SAMISARA_CONFIG_MACROS          (1u<<1)
+#define SAMISARA_CONFIG_POLL            (1u<<2)
+#define SAMISARA_CONFIG_ALL             0x07
+
+/* Define steps [first, first+nr) of a macro. Unsaved changes are lost at
+ * reset, as for SAMISARA_CMD_KEYMAP. */
+#define SAMISARA_CMD_MACRO              9
+struct packed samisara_cmd_macro {
+    uint8_t macro;
+    uint8_t first;
+    uint8_t nr;
+    struct packed samisara_macro_step {
+        uint8_t op;  /* SAMISARA_MACRO_* */
+        uint8_t arg;
+    } step[20]; /* Command length covers only the first nr */
+};
+
+/* Select the keyboard endpoint's polling interval: 1, 2, 4, 8 or 10 ms.
+ * If changed, the configuration is saved and the device re-enumerates. */
+#define SAMISARA_CMD_POLL               10
+struct packed samisara_cmd_poll {
+    uint8_t interval_ms;
+};
+
+/* Freeze (1) or unfreeze (0) the USB flight recorder. The host freezes it
+ * while reading SAMISARA_SUBREPORT_USBLOG, which would otherwise record
+ * the control transfers of the dump itself. */
+#define SAMISARA_CMD_USBLOG             11
+struct packed samisara_cmd_usblog {
+    uint8_t frozen;
+};
+
+#define SAMISARA_CMD_MAX                11
+
+/* Keymaps translate each Amiga keycode to a USB HID usage (Keyboard/Keypad
+ * page, 0x01-0xE7), or to 0 for no key. Layer 0 is the base layer. While
+ * any key mapped to FN is held, layer 1 applies instead: its 0 entries are
+ * transparent, taking the usage from layer 0. A key mapped to MACRO(n)
+ * plays back macro n when pressed. */
+#define SAMISARA_KEYMAP_LAYERS          2
+#define SAMISARA_KEYMAP_KEYS            104
+#define SAMISARA_KEYMAP_MACRO(n)        (0xf0 + (n))
+#define SAMISARA_KEYMAP_FN              0xff
+
+/* Macros are sequences of steps, played back as one report per host poll.
+ * Playback ends at the first END step, and keys still pressed are then
+ * released. Pressing a macro key during playback has no effect. */
+#define SAMISARA_NR_MACROS              8
+#define SAMISARA_MACRO_STEPS            64
+#define SAMISARA_MACRO_END              0
+#define SAMISARA_MACRO_PRESS            1 /* arg = USB usage */
+#define SAMISARA_MACRO_RELEASE          2 /* arg = USB usage */
+#define SAMISARA_MACRO_TAP              3 /* Press, then release, arg */
+#define SAMISARA_MACRO_DELAY            4 /* arg = milliseconds */
 
 /*
  * SAMISARA SUBREPORTS
@@ -62,7 +167,170 @@ struct packed samisara_subreport_info {
 #define SAMISARA_SUBREPORT_BUILD_VER    1
 #define SAMISARA_SUBREPORT_BUILD_DATE   2
 
-#define SAMISARA_SUBREPORT_MAX          2
+/* Matrix column settle times, as measured by calibration. The scan engine
+ * allows each column min(2*measured_ns + margin_ns, max_ns) to settle. */
+#define SAMISARA_SUBREPORT_SETTLE       3
+struct packed samisara_subreport_settle {
+    uint16_t margin_ns;
+    uint16_t max_ns;
+    uint16_t nr_calibrations;
+    uint16_t measured_ns[15]; /* 0xffff: Did not settle */
+};
+
+/* Current debounce configuration, as struct samisara_cmd_debounce. */
+#define SAMISARA_SUBREPORT_DEBOUNCE     4
+
+/* Idle-mode configuration and statistics. */
+#define SAMISARA_SUBREPORT_IDLE         5
+struct packed samisara_subreport_idle {
+    uint16_t timeout_ms;
+    uint32_t nr_wakeups;
+};
+
+/* Matrix ghost-key statistics. */
+#define SAMISARA_SUBREPORT_GHOST        6
+struct packed samisara_subreport_ghost {
+    uint32_t nr_detected; /* Ghost rectangles detected */
+    uint32_t nr_held;     /* Ambiguous key presses held back */
+};
+
+/* Key-event queue between the debouncer and the USB report sender. */
+#define SAMISARA_SUBREPORT_EVENTS       7
+struct packed samisara_subreport_events {
+    uint16_t nr_slots;
+    uint16_t depth;        /* Events currently queued */
+    uint16_t max_depth;    /* High watermark */
+    uint32_t nr_events;    /* Events queued */
+    uint32_t nr_overflows; /* Occasions on which the queue filled */
+};
+
+/* Cycle-count statistics for the code region specified by arg. The mean is
+ * total/count. Histogram bucket b counts regions of [2^(b+bucket_shift),
+ * 2^(b+bucket_shift+1)) cycles, with the first and last buckets also
+ * counting all shorter and longer regions. */
+#define SAMISARA_SUBREPORT_STATS        8
+struct packed samisara_subreport_stats {
+    uint8_t region;
+    uint8_t nr_regions;
+    char name[8]; /* Not NUL terminated if 8 characters long */
+    uint16_t cpu_mhz;
+    uint8_t nr_buckets;
+    uint8_t bucket_shift;
+    uint32_t count;
+    uint32_t min, max;
+    uint64_t total;
+};
+
+/* Histogram buckets [first, first+nr) for a code region.
+ * arg[7:0] = region, arg[15:8] = first bucket. */
+#define SAMISARA_SUBREPORT_STATS_HIST   9
+struct packed samisara_subreport_stats_hist {
+    uint8_t region;
+    uint8_t first;
+    uint8_t nr;
+    uint32_t bucket[10];
+};
+
+/* Keymap entries [first, first+nr) of a layer, as struct
+ * samisara_cmd_keymap. arg[7:0] = layer, arg[15:8] = first. */
+#define SAMISARA_SUBREPORT_KEYMAP       10
+
+/* Macro steps [first, first+nr), as struct samisara_cmd_macro.
+ * arg[7:0] = macro, arg[15:8] = first. */
+#define SAMISARA_SUBREPORT_MACRO        11
+
+/* Keypress latency over the most recent nr_samples key events, measured
+ * from the first matrix scan which saw each raw key edge. Stage 0 ends when
+ * the report carrying the event is queued for the host; stage 1 runs from
+ * there until the host collects it; stage 2 is the total. */
+#define SAMISARA_SUBREPORT_LATENCY      12
+struct packed samisara_subreport_latency {
+    uint32_t nr_events; /* Events traced since reset */
+    uint16_t nr_samples;
+    struct packed samisara_latency {
+        uint32_t p50_us, p99_us, max_us;
+    } stage[3];
+};
+
+/* Keyboard endpoint polling interval, as struct samisara_cmd_poll. */
+#define SAMISARA_SUBREPORT_POLL         13
+
+/* USB flight recorder: records [first, first+nr) of the most recent 64
+ * USB events. arg = first. Indexes are free running: If arg is no longer
+ * (or not yet) recorded, first is the oldest record available. */
+#define SAMISARA_SUBREPORT_USBLOG       14
+struct packed samisara_subreport_usblog {
+    uint16_t prod;    /* Index of the next record */
+    uint16_t first;
+    uint8_t nr;
+    uint8_t time_mhz; /* Rate of the free-running record timestamps */
+    struct packed samisara_usblog_rec {
+        uint32_t time;
+        uint8_t type; /* SAMISARA_USBLOG_* */
+        union packed {
+            uint8_t setup[8]; /* SETUP: The Setup packet */
+            struct packed {
+                uint8_t ep;   /* Endpoint address */
+                uint16_t len; /* IN, OUT: Packet length */
+            };
+        };
+    } rec[3];
+};
+#define SAMISARA_USBLOG_RESET           1
+#define SAMISARA_USBLOG_SUSPEND         2
+#define SAMISARA_USBLOG_RESUME          3
+#define SAMISARA_USBLOG_WAKEUP          4 /* Remote wakeup signalled */
+#define SAMISARA_USBLOG_SETUP           5
+#define SAMISARA_USBLOG_IN              6 /* IN packet collected by host */
+#define SAMISARA_USBLOG_OUT             7 /* OUT packet received */
+#define SAMISARA_USBLOG_STATUS          8 /* EP0 Status stage complete */
+#define SAMISARA_USBLOG_STALL           9
+
+#define SAMISARA_SUBREPORT_MAX          14
+
+/*
+ * TELEMETRY
+ * 
+ * Records are pushed to the host as Input Reports on the vendor
+ * interface's interrupt IN endpoint, as soon as they are logged and the
+ * host is polling:
+ *  uint8_t report_id;  SAMISARA_TELEMETRY_REPORT_ID
+ *  struct samisara_telemetry;
+ *  uint8_t pad_mbz[];
+ */
+#define SAMISARA_TELEMETRY_REPORT_ID    0x02
+#define SAMISARA_TELEMETRY_REPORT_SZ    63
+struct packed samisara_telemetry {
+    uint8_t seq;      /* Increments with each report */
+    uint8_t nr;       /* Valid entries in rec[] */
+    uint8_t dropped;  /* Records lost since the previous report (saturating) */
+    uint8_t time_mhz; /* Rate of the free-running record timestamps */
+    struct packed samisara_telemetry_rec {
+        uint32_t time;
+        uint8_t type;   /* SAMISARA_TELEMETRY_* */
+        uint8_t id;
+        uint16_t val;
+    } rec[7];
+};
+
+/* Key edge, timestamped by the first scan which saw it. id = Amiga keycode,
+ * val = 1 (pressed) or 0 (released). */
+#define SAMISARA_TELEMETRY_KEY          1
+
+/* Counter, sent once a second. id = SAMISARA_COUNTER_*, val = bits 15:0
+ * of the counter's value. */
+#define SAMISARA_TELEMETRY_COUNTER      2
+#define SAMISARA_COUNTER_EVENTS         0 /* Key events queued */
+#define SAMISARA_COUNTER_OVERFLOWS      1 /* Key-event queue overflows */
+#define SAMISARA_COUNTER_GHOSTS         2 /* Ghost rectangles detected */
+#define SAMISARA_COUNTER_GHOST_HELD     3 /* Key presses held back */
+#define SAMISARA_COUNTER_WAKEUPS        4 /* Wakeups from idle mode */
+
+/* Error. id = SAMISARA_ERROR_*, val is error specific. */
+#define SAMISARA_TELEMETRY_ERROR        3
+#define SAMISARA_ERROR_OVERFLOW         0 /* Key-event queue full */
+#define SAMISARA_ERROR_GHOST            1 /* Ghost rectangle detected */
+#define SAMISARA_ERROR_SETTLE           2 /* val = Column did not settle */
 
 /*
  * COMMAND RESULTS
@@ -0,0 +1,54 @@
+/*
+ * stats.h
+ * 
+ * Cycle-count statistics for hot-path code regions.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Instrumented regions. Names are listed in stats.c. */
+enum {
+    STATS_LOOP,      /* One main-loop iteration, excluding sleep */
+    STATS_USB,       /* usb_process() */
+    STATS_KEYBOARD,  /* keyboard_process() */
+    STATS_SNAPSHOT,  /* Processing of one matrix snapshot */
+    STATS_SCAN_STEP, /* One column step of the scan engine */
+    STATS_SLEEP,     /* One main-loop WFI, measured by the system timer */
+    NR_STATS
+};
+
+/* Histogram bucket b counts regions of [2^(b+SHIFT), 2^(b+SHIFT+1)) cycles.
+ * The first and last buckets also count all shorter and longer regions. */
+#define STATS_NR_BUCKETS   16
+#define STATS_BUCKET_SHIFT  4
+
+void stats_init(void);
+void stats_reset(void);
+
+/* Mark the start and end of an instrumented region. */
+static inline uint32_t stats_start(void)
+{
+    return dwt->cyccnt;
+}
+void stats_add(unsigned int region, uint32_t cycles);
+static inline void stats_end(unsigned int region, uint32_t start)
+{
+    stats_add(region, dwt->cyccnt - start);
+}
+
+bool_t stats_get(unsigned int region, struct samisara_subreport_stats *s);
+bool_t stats_get_hist(unsigned int region, unsigned int first,
+                      struct samisara_subreport_stats_hist *h);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
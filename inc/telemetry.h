@@ -0,0 +1,33 @@
+/*
+ * telemetry.h
+ * 
+ * Telemetry records pushed to the host on the vendor interface.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+void telemetry_init(void);
+
+/* Start and stop the stream, when the vendor interface is configured and
+ * when the bus is reset. */
+void telemetry_start(void);
+void telemetry_stop(void);
+
+/* Log a record (SAMISARA_TELEMETRY_*). Thread context only. */
+void telemetry_log(uint8_t type, uint8_t id, uint16_t val, time_t time);
+
+/* Send queued records to the host, if it is ready for them. */
+void telemetry_process(void);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
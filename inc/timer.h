@@ -23,6 +23,10 @@ void timer_cancel(struct timer *timer);
 
 void timers_init(void);
 
+/* The timer's bus clock is now divided by @div from its nominal rate.
+ * Pending deadlines are rescaled to suit. */
+void timers_clock_div(unsigned int div);
+
 /*
  * Local variables:
  * mode: C
@@ -18,17 +18,32 @@ extern unsigned int usb_bulk_mps;
 struct usb_class_ops {
     void (*reset)(void);
     void (*configure)(void);
+    void (*suspend)(void);
+    void (*resume)(void);
 };
 extern const struct usb_class_ops usb_class_ops;
 
-/* USB Endpoints for HID communications. */
-#define EP_TX 1
+/* USB Endpoints for HID communications. Numbers are allocated by usb_init(),
+ * and the endpoints are configured by the host. */
+extern uint8_t ep_tx, ep_telemetry;
 
 /* Main entry points for USB processing. */
 void usb_init(void);
 void usb_deinit(void);
 void usb_process(void);
 
+/* Detach from the host and reattach, so that the device is re-enumerated.
+ * Deferred briefly, so that the current control transfer can complete. */
+void usb_reconnect(void);
+
+/* Is the bus suspended by the host? */
+bool_t usb_is_suspended(void);
+
+/* Wake a suspended host, if it has enabled remote wakeup. Resume signalling
+ * is driven by usb_process(); usb_class_ops.resume() is called once it is
+ * done. Returns FALSE if remote wakeup is not currently possible. */
+bool_t usb_remote_wakeup(void);
+
 /* Does OUT endpoint have data ready? If so return packet length, else -1. */
 int ep_rx_ready(uint8_t ep);
 
@@ -39,6 +54,10 @@ void usb_read(uint8_t ep, void *buf, uint32_t len);
 /* Is IN endpoint ready for next packet? */
 bool_t ep_tx_ready(uint8_t ep);
 
+/* Time at which the most recent IN packet was collected by the host. 
+ * Valid only once ep_tx_ready(@ep) == TRUE following usb_write(@ep). */
+time_t ep_tx_time(uint8_t ep);
+
 /* Queue the next IN packet, with the given payload data. 
  * REQUIRES: ep_tx_ready(@ep) == TRUE */
 void usb_write(uint8_t ep, const void *buf, uint32_t len);
@@ -76,8 +76,20 @@ int snprintf(char *str, size_t size, const char *format, ...)
 
 uint32_t udiv64(uint64_t dividend, uint32_t divisor);
 
+uint16_t crc16_ccitt(const void *buf, size_t len, uint16_t crc);
+
 void reset_to_bootloader(void);
 
+/* Work for the main loop, which sleeps until some is posted. Interrupt
+ * handlers post work rather than doing it themselves. */
+enum {
+    WORK_USB,       /* usb_process() */
+    WORK_KEYBOARD,  /* keyboard_process() */
+    WORK_TELEMETRY, /* telemetry_process() */
+    WORK_CONFIG,    /* config_save() */
+};
+void work_post(unsigned int work);
+
 /* Board-specific callouts */
 void board_init(void);
 void act_led(bool_t on);
@@ -103,11 +115,6 @@ static inline int printk(const char *format, ...) { return 0; }
 
 #endif
 
-/* Keyboard */
-void keyboard_init(void);
-void keyboard_process(void);
-uint8_t kbd_led(void);
-
 /* Build info. */
 extern const char build_ver[];
 extern const char build_date[];
@@ -0,0 +1,208 @@
+# mk_scan_tables.py
+#
+# Generate the A600/A1200 keyboard matrix scan tables as a C header.
+#
+# The matrix layout, pin assignments and Amiga-to-USB keycode translation are
+# described below. From these we precompute everything the scan loop needs:
+# BSRR words for each column strobe, fused matrix-position-to-keycode tables,
+# a keycode-to-USB-usage table, per-port pin masks, and the EXTI wake sources
+# for idle mode.
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys, os
+
+NA = None
+
+# Rows 1-6: PA0-5
+rows = ('A', [0, 1, 2, 3, 4, 5])
+
+# Columns 1-15: (GPIO, pin, [Amiga keycode for each of Rows 1-6])
+columns = [
+    ('B', 15, [0x45, 0x00, 0x42, 0x62, 0x30, 0x5d]),
+    ('B', 14, [0x5a, 0x01, 0x10, 0x20, 0x31, 0x5e]),
+    ('B', 13, [0x50, 0x02, 0x11, 0x21, 0x32, 0x3f]),
+    ('B', 12, [0x51, 0x03, 0x12, 0x22, 0x33, 0x2f]),
+    ('B', 11, [0x52, 0x04, 0x13, 0x23, 0x34, 0x1f]),
+    ('B', 10, [0x53, 0x05, 0x14, 0x24, 0x35, 0x3c]),
+    ('B',  9, [0x54, 0x06, 0x15, 0x25, 0x36, 0x3e]),
+    ('B',  8, [0x5b, 0x07, 0x16, 0x26, 0x37, 0x2e]),
+    ('B',  7, [0x55, 0x08, 0x17, 0x27, 0x38, 0x1e]),
+    ('B',  6, [0x5c, 0x09, 0x18, 0x28, 0x39, 0x43]),
+    ('B',  5, [0x56, 0x0a, 0x19, 0x29, 0x3a, 0x3d]),
+    ('B',  4, [0x57, 0x0b, 0x1a, 0x2a, NA,   0x2d]),
+    ('B',  3, [0x58, 0x0c, 0x1b, 0x2b, 0x40, 0x1d]),
+    ('B',  1, [0x59, 0x0d, 0x44, 0x46, 0x41, 0x0f]),
+    ('B',  0, [0x5f, 0x4c, 0x4f, 0x4e, 0x4d, 0x4a])
+]
+
+# Special keys, each on a dedicated pin: (Amiga keycode, GPIO, pin, name)
+special_keys = [
+    (0x61, 'A',  6, 'R.Shift'),
+    (0x65, 'A',  7, 'R.Alt'),
+    (0x67, 'A',  8, 'R.Amiga'),
+    (0x63, 'C', 13, 'Ctrl'),
+    (0x60, 'C', 15, 'L.Shift'),
+    (0x64, 'C', 14, 'L.Alt'),
+    (0x66, 'A', 15, 'L.Amiga')
+]
+
+# Amiga keycode -> USB HID usage (Keyboard/Keypad page)
+amiga_usb_map = [
+    0x35, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, # 00-07
+    0x25, 0x26, 0x27, 0x2d, 0x2e, 0x31, NA,   0x62, # 08-0f
+    0x14, 0x1a, 0x08, 0x15, 0x17, 0x1c, 0x18, 0x0c, # 10-17
+    0x12, 0x13, 0x2f, 0x30, NA,   0x59, 0x5a, 0x5b, # 18-1f
+    0x04, 0x16, 0x07, 0x09, 0x0a, 0x0b, 0x0d, 0x0e, # 20-27
+    0x0f, 0x33, 0x34, 0x32, NA,   0x5c, 0x5d, 0x5e, # 28-2f
+    0x64, 0x1d, 0x1b, 0x06, 0x19, 0x05, 0x11, 0x10, # 30-37
+    0x36, 0x37, 0x38, NA,   0x63, 0x5f, 0x60, 0x61, # 38-3f
+    0x2c, 0x2a, 0x2b, 0x58, 0x28, 0x29, 0x4c, NA,   # 40-47
+    NA,   NA,   0x56, NA,   0x52, 0x51, 0x4f, 0x50, # 48-4f
+    0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, # 50-57
+    0x42, 0x43, 0x53, 0x47, 0x54, 0x55, 0x57, 0x49, # 58-5f
+    0xe1, 0xe5, 0x39, 0xe0, 0xe2, 0xe6, 0xe3, 0xe7  # 60-67
+]
+
+NR_KEYS = 128
+KEY_NONE = 0xff
+
+def key(code):
+    return KEY_NONE if code is None else code
+
+def usb(code):
+    if code >= len(amiga_usb_map) or amiga_usb_map[code] is None:
+        return 0
+    return amiga_usb_map[code]
+
+def mask(pins):
+    m = 0
+    for p in pins:
+        m |= 1 << p
+    return m
+
+def main(argv):
+    out = []
+    emit = out.append
+
+    col_gpios = set(g for (g, _, _) in columns)
+    assert len(col_gpios) == 1, "Columns must share a single GPIO port"
+    col_gpio = col_gpios.pop()
+    sk_gpios = sorted(set(g for (_, g, _, _) in special_keys))
+    assert len(sk_gpios) == 2, "Special keys must span exactly two ports"
+    nr_rows = len(rows[1])
+    assert rows[1] == list(range(nr_rows)), "Rows must be pins 0..n-1"
+
+    emit('/* Automatically generated by %s: do not edit. */'
+         % os.path.basename(argv[0]))
+    emit('')
+    emit('/* Keys are identified by Amiga keycode. */')
+    emit('#define NR_KEYS %d' % NR_KEYS)
+    emit('#define KEY_NONE 0x%02x' % KEY_NONE)
+    emit('')
+    emit('#define NR_COLS %d' % len(columns))
+    emit('#define NR_ROWS %d' % nr_rows)
+    emit('#define gpio_row gpio%s' % rows[0].lower())
+    emit('#define ROW_MASK 0x%04x' % mask(rows[1]))
+    emit('#define gpio_col gpio%s' % col_gpio.lower())
+    emit('#define COL_MASK 0x%04x' % mask(p for (_, p, _) in columns))
+    emit('')
+
+    # Special keys are sampled by reading two ports. The pressed keys on the
+    # first port appear in bits 0-15 of the sample, and those on the second
+    # port in bits 16-31.
+    for i, g in enumerate(sk_gpios):
+        m = mask(p for (_, _g, p, _) in special_keys if _g == g)
+        emit('#define gpio_special%d gpio%s' % (i, g.lower()))
+        emit('#define SPECIAL%d_MASK 0x%04x' % (i, m))
+    emit('')
+
+    # Idle mode wakes on a falling edge on any row or special-key pin. Each
+    # EXTI line can be routed from only one port: rows have first claim,
+    # and special keys which lose out must be polled instead.
+    exti_port = {}
+    for p in rows[1]:
+        exti_port[p] = rows[0]
+    idle_poll = 0
+    for (_, g, p, _) in special_keys:
+        if exti_port.setdefault(p, g) != g:
+            idle_poll |= 1 << (p + 16*sk_gpios.index(g))
+    emit('/* EXTI lines which wake from idle, and their AFIO_EXTICRx'
+         ' values. */')
+    emit('#define EXTI_MASK 0x%04x' % mask(exti_port.keys()))
+    emit('const static uint16_t exticr[4] = {')
+    l = []
+    for i in range(4):
+        x = 0
+        for j in range(4):
+            g = exti_port.get(i*4 + j, 'A')
+            x |= (ord(g) - ord('A')) << (j*4)
+        l.append('    0x%04x' % x)
+    emit(',\n'.join(l))
+    emit('};')
+    emit('/* Special-key sample bits with no EXTI line: polled during'
+         ' idle. */')
+    emit('#define IDLE_POLL_MASK 0x%08x' % idle_poll)
+    emit('')
+
+    emit('/* BSRR words to strobe (drive low) and release each column. */')
+    emit('const static uint32_t col_strobe_bsrr[NR_COLS] = {')
+    emit(',\n'.join('    0x%08x' % (0x10000 << p) for (_, p, _) in columns))
+    emit('};')
+    emit('const static uint32_t col_release_bsrr[NR_COLS] = {')
+    emit(',\n'.join('    0x%08x' % (1 << p) for (_, p, _) in columns))
+    emit('};')
+    emit('')
+
+    emit('/* DMA strobe sequence: Entry i releases column i, strobes i+1. */')
+    emit('const static uint32_t col_dma_bsrr[NR_COLS] = {')
+    l = []
+    for i, (_, p, _) in enumerate(columns):
+        q = columns[(i+1) % len(columns)][1]
+        l.append('    0x%08x' % ((1 << p) | (0x10000 << q)))
+    emit(',\n'.join(l))
+    emit('};')
+    emit('')
+
+    emit('/* Matrix position (column, row) -> Amiga keycode. */')
+    emit('const static uint8_t matrix_key[NR_COLS][NR_ROWS] = {')
+    l = []
+    for (_, p, codes) in columns:
+        l.append('    { ' + ', '.join('0x%02x' % key(c) for c in codes)
+                 + ' }')
+    emit(',\n'.join(l))
+    emit('};')
+    emit('')
+
+    # Only bits within SPECIAL*_MASK are ever looked up.
+    emit('/* Special-key sample bit -> Amiga keycode. */')
+    emit('const static uint8_t special_key[32] = {')
+    l = []
+    for (code, g, p, name) in special_keys:
+        b = p + 16*sk_gpios.index(g)
+        l.append('    [%2d] = 0x%02x /* %s */' % (b, code, name))
+    emit(',\n'.join(l))
+    emit('};')
+    emit('')
+
+    emit('/* Amiga keycode -> USB HID usage. 0 = No mapping. */')
+    emit('const static uint8_t key_usb[NR_KEYS] = {')
+    l = []
+    for i in range(0, NR_KEYS, 8):
+        l.append('    ' + ', '.join('0x%02x' % usb(c) for c in range(i, i+8))
+                 + ', /* %02x-%02x */' % (i, i+7))
+    emit('\n'.join(l))
+    emit('};')
+
+    with open(argv[1], 'w') as f:
+        f.write('\n'.join(out) + '\n')
+
+if __name__ == "__main__":
+    main(sys.argv)
+
+# Local variables:
+# python-indent: 4
+# End:
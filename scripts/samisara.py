@@ -11,9 +11,29 @@ import struct, subprocess, sys
 class Cmd:
     Subreport       =  0
     DFU             =  1
+    Calibrate       =  2
+    Debounce        =  3
+    Idle            =  4
+    StatsReset      =  5
+    Keymap          =  6
+    ConfigSave      =  7
+    ConfigReset     =  8
+    Macro           =  9
+    Poll            = 10
+    USBLog          = 11
     str = {
         Subreport: "Subreport",
-        DFU: "DFU"
+        DFU: "DFU",
+        Calibrate: "Calibrate",
+        Debounce: "Debounce",
+        Idle: "Idle",
+        StatsReset: "StatsReset",
+        Keymap: "Keymap",
+        ConfigSave: "ConfigSave",
+        ConfigReset: "ConfigReset",
+        Macro: "Macro",
+        Poll: "Poll",
+        USBLog: "USBLog"
     }
 
 ## Command responses/acknowledgements
@@ -26,6 +46,97 @@ class Subreport:
     Info            = 0
     BuildVer        = 1
     BuildDate       = 2
+    Settle          = 3
+    Debounce        = 4
+    Idle            = 5
+    Ghost           = 6
+    Events          = 7
+    Stats           = 8
+    StatsHist       = 9
+    Keymap          = 10
+    Macro           = 11
+    Latency         = 12
+    Poll            = 13
+    USBLog          = 14
+
+## Keymap geometry
+class Keymap:
+    Layers          = 2
+    Keys            = 104
+    Macro           = 0xf0
+    FN              = 0xff
+    Chunk           = 40
+
+## Macro steps
+class Macro:
+    Nr              = 8
+    Steps           = 64
+    End             = 0
+    Press           = 1
+    Release         = 2
+    Tap             = 3
+    Delay           = 4
+    Chunk           = 20
+
+## Telemetry records
+class Telemetry:
+    ReportID        = 0x02
+    ReportLength    = 63
+    Key             = 1
+    Counter         = 2
+    Error           = 3
+    counters = [ 'events', 'overflows', 'ghosts', 'ghost-held', 'wakeups' ]
+    errors = [ 'event queue full', 'ghost keys', 'column did not settle' ]
+
+## USB flight recorder records
+class USBLog:
+    Records         = 64
+    Reset           = 1
+    Suspend         = 2
+    Resume          = 3
+    Wakeup          = 4
+    Setup           = 5
+    In              = 6
+    Out             = 7
+    Status          = 8
+    Stall           = 9
+    str = {
+        Reset: "RESET",
+        Suspend: "SUSPEND",
+        Resume: "RESUME",
+        Wakeup: "WAKEUP",
+        Setup: "SETUP",
+        In: "IN",
+        Out: "OUT",
+        Status: "STATUS",
+        Stall: "STALL"
+    }
+    std_req = [ 'GET_STATUS', 'CLEAR_FEATURE', None, 'SET_FEATURE', None,
+                'SET_ADDRESS', 'GET_DESCRIPTOR', 'SET_DESCRIPTOR',
+                'GET_CONFIGURATION', 'SET_CONFIGURATION', 'GET_INTERFACE',
+                'SET_INTERFACE', 'SYNCH_FRAME' ]
+    desc = { 1: 'Device', 2: 'Configuration', 3: 'String', 4: 'Interface',
+             5: 'Endpoint', 6: 'Qualifier', 0x21: 'HID', 0x22: 'Report' }
+    hid_req = { 1: 'Report', 2: 'Idle', 3: 'Protocol' }
+    recip = [ 'dev', 'if', 'ep', 'other' ]
+
+## Configuration sections, for Cmd.ConfigReset
+class Config:
+    Keymap          = 1
+    Macros          = 2
+    Poll            = 4
+    All             = 7
+
+## Debounce modes
+class Debounce:
+    NoDebounce      = 0
+    Eager           = 1
+    Deferred        = 2
+    str = {
+        NoDebounce: "none",
+        Eager: "eager",
+        Deferred: "deferred"
+    }
 
 report_id = 0x01
 report_length = 48
@@ -39,14 +150,18 @@ class Unit:
              + pkt + bytes(report_length - len(pkt) - 2))
         self.hid.send_feature_report(x)
 
-    def set_subreport(self, idx):
-        self._send_cmd(Cmd.Subreport, struct.pack('<H', idx))
+    def set_subreport(self, idx, arg=0):
+        # Omit a zero argument, for compatibility with older firmware.
+        pkt = struct.pack('<H', idx)
+        if arg != 0:
+            pkt += struct.pack('<H', arg)
+        self._send_cmd(Cmd.Subreport, pkt)
 
     def enter_dfu(self):
         self._send_cmd(Cmd.DFU, struct.pack('<I', 0xdeadbeef))
 
-    def get_subreport(self, idx):
-        self.set_subreport(idx)
+    def get_subreport(self, idx, arg=0):
+        self.set_subreport(idx, arg)
         x = self.hid.get_feature_report(report_id, report_length+1)
         assert x[0] == report_id
         assert x[1] == idx
@@ -60,6 +175,149 @@ class Unit:
         x = self.get_subreport(Subreport.BuildDate)
         return x.decode('utf-8')
 
+    def calibrate(self):
+        self._send_cmd(Cmd.Calibrate, b'')
+
+    def settle(self):
+        x = self.get_subreport(Subreport.Settle)
+        margin, max_ns, nr = struct.unpack('<3H', x[:6])
+        measured = struct.unpack('<15H', x[6:36])
+        return margin, max_ns, nr, measured
+
+    def set_debounce(self, mode, eager_ms, deferred_ms):
+        self._send_cmd(Cmd.Debounce,
+                       struct.pack('3B', mode, eager_ms, deferred_ms))
+        return self.debounce() == (mode, eager_ms, deferred_ms)
+
+    def debounce(self):
+        x = self.get_subreport(Subreport.Debounce)
+        return struct.unpack('3B', x[:3])
+
+    def set_idle_timeout(self, timeout_ms):
+        self._send_cmd(Cmd.Idle, struct.pack('<H', timeout_ms))
+
+    def idle(self):
+        x = self.get_subreport(Subreport.Idle)
+        return struct.unpack('<HI', x[:6])
+
+    def ghost(self):
+        x = self.get_subreport(Subreport.Ghost)
+        return struct.unpack('<2I', x[:8])
+
+    def events(self):
+        x = self.get_subreport(Subreport.Events)
+        return struct.unpack('<3H2I', x[:14])
+
+    def reset_stats(self):
+        self._send_cmd(Cmd.StatsReset, b'')
+
+    def stats(self, region):
+        x = self.get_subreport(Subreport.Stats, region)
+        (region, nr_regions, name, mhz, nr_buckets, shift,
+         count, cmin, cmax, total) = struct.unpack('<2B8sH2B3IQ', x[:34])
+        s = { 'nr_regions': nr_regions,
+              'name': name.rstrip(b'\0').decode('utf-8'),
+              'mhz': mhz, 'shift': shift,
+              'count': count, 'min': cmin, 'max': cmax, 'total': total }
+        hist = []
+        while len(hist) < nr_buckets:
+            x = self.get_subreport(Subreport.StatsHist,
+                                   region | (len(hist) << 8))
+            _, first, nr = struct.unpack('3B', x[:3])
+            assert first == len(hist) and nr != 0
+            hist += struct.unpack('<%dI' % nr, x[3:3+4*nr])
+        s['hist'] = hist
+        return s
+
+    def latency(self):
+        x = self.get_subreport(Subreport.Latency)
+        nr_events, nr_samples = struct.unpack('<IH', x[:6])
+        stages = [struct.unpack('<3I', x[6+12*i:18+12*i]) for i in range(3)]
+        return nr_events, nr_samples, stages
+
+    def set_keymap(self, layer, first, usages):
+        for i in range(0, len(usages), Keymap.Chunk):
+            u = bytes(usages[i:i+Keymap.Chunk])
+            self._send_cmd(Cmd.Keymap,
+                           struct.pack('3B', layer, first + i, len(u)) + u)
+        x = self.keymap(layer)
+        return x[first:first+len(usages)] == list(usages)
+
+    def keymap(self, layer):
+        usages = []
+        while len(usages) < Keymap.Keys:
+            x = self.get_subreport(Subreport.Keymap,
+                                   layer | (len(usages) << 8))
+            _, first, nr = struct.unpack('3B', x[:3])
+            assert first == len(usages) and nr != 0
+            usages += list(x[3:3+nr])
+        return usages
+
+    def set_macro(self, idx, steps):
+        steps = steps + [(Macro.End, 0)]
+        for i in range(0, len(steps), Macro.Chunk):
+            s = steps[i:i+Macro.Chunk]
+            pkt = struct.pack('3B', idx, i, len(s))
+            for op, arg in s:
+                pkt += struct.pack('2B', op, arg)
+            self._send_cmd(Cmd.Macro, pkt)
+        return self.macro(idx) == steps[:-1]
+
+    def macro(self, idx):
+        steps = []
+        while len(steps) < Macro.Steps:
+            x = self.get_subreport(Subreport.Macro, idx | (len(steps) << 8))
+            _, first, nr = struct.unpack('3B', x[:3])
+            assert first == len(steps) and nr != 0
+            steps += list(struct.unpack('2B', x[3+2*i:5+2*i])
+                          for i in range(nr))
+        n = next((i for i, (op, _) in enumerate(steps) if op == Macro.End),
+                 len(steps))
+        return steps[:n]
+
+    def set_poll(self, interval_ms):
+        self._send_cmd(Cmd.Poll, struct.pack('B', interval_ms))
+
+    def poll(self):
+        x = self.get_subreport(Subreport.Poll)
+        return x[0]
+
+    def save_config(self):
+        self._send_cmd(Cmd.ConfigSave, b'')
+
+    def reset_config(self, sections=Config.All):
+        self._send_cmd(Cmd.ConfigReset, struct.pack('B', sections))
+
+    # Returns (time_mhz, [(time, type, data), ...]) for the records in the
+    # USB flight recorder, oldest first. Recording is frozen meanwhile.
+    def usblog(self):
+        self._send_cmd(Cmd.USBLog, struct.pack('B', 1))
+        try:
+            x = self.get_subreport(Subreport.USBLog)
+            prod, _, _, mhz = struct.unpack('<2H2B', x[:6])
+            idx, recs = (prod - USBLog.Records) & 0xffff, []
+            while idx != prod:
+                x = self.get_subreport(Subreport.USBLog, idx)
+                _, first, nr, _ = struct.unpack('<2H2B', x[:6])
+                recs += [struct.unpack('<IB8s', x[6+13*i:19+13*i])
+                         for i in range(nr)]
+                idx = (first + nr) & 0xffff
+        finally:
+            self._send_cmd(Cmd.USBLog, struct.pack('B', 0))
+        return mhz, recs
+
+    # Yields (seq, dropped, time_mhz, [(time, type, id, val), ...]) for
+    # each telemetry report received.
+    def telemetry(self):
+        while True:
+            x = bytes(self.hid.read(Telemetry.ReportLength + 1, 1000))
+            if len(x) < 5 or x[0] != Telemetry.ReportID:
+                continue
+            seq, nr, dropped, mhz = struct.unpack('4B', x[1:5])
+            recs = [struct.unpack('<I2BH', x[5+8*i:13+8*i])
+                    for i in range(nr)]
+            yield seq, dropped, mhz, recs
+
 def print_info_line(name: str, value: str, tab=0) -> None:
     print(''.ljust(tab) + (name + ':').ljust(12-tab) + value)
 
@@ -84,11 +342,133 @@ def run_dfu_util(dfu_file):
                '-D', dfu_file, '-s', ':leave']
     subprocess.run(dfu_cmd)
 
+# Keymap usages are hex, 'fn', or 'm<n>' to play macro n.
+def keymap_usage_str(u):
+    if u == Keymap.FN:
+        return 'fn'
+    if u >= Keymap.Macro:
+        return 'm%u' % (u - Keymap.Macro)
+    return '%02x' % u
+
+# Keymap entries are '<layer> <amiga_keycode> <usage>', one per line.
+def parse_keymap_entry(words):
+    if len(words) != 3:
+        raise ValueError('bad keymap entry: ' + ' '.join(words))
+    layer, key, u = int(words[0], 0), int(words[1], 16), words[2]
+    if u == 'fn':
+        usage = Keymap.FN
+    elif u.startswith('m') and u[1:].isdigit() and int(u[1:]) < Macro.Nr:
+        usage = Keymap.Macro + int(u[1:])
+    else:
+        usage = int(u, 16)
+    if (layer >= Keymap.Layers or key >= Keymap.Keys
+        or (usage > 0xe7 and usage != Keymap.FN
+            and not Keymap.Macro <= usage < Keymap.Macro + Macro.Nr)):
+        raise ValueError('bad keymap entry: ' + ' '.join(words))
+    return layer, key, usage
+
+# US layout: ASCII -> (usage, shifted)
+ascii_usage = {' ': (0x2c, False), '\n': (0x28, False), '\t': (0x2b, False)}
+for i, c in enumerate('abcdefghijklmnopqrstuvwxyz'):
+    ascii_usage[c] = (0x04 + i, False)
+    ascii_usage[c.upper()] = (0x04 + i, True)
+for i, (c, s) in enumerate(zip('1234567890', '!@#$%^&*()')):
+    ascii_usage[c] = (0x1e + i, False)
+    ascii_usage[s] = (0x1e + i, True)
+for i, (c, s) in enumerate(zip('-=[]\\', '_+{}|')):
+    ascii_usage[c] = (0x2d + i, False)
+    ascii_usage[s] = (0x2d + i, True)
+for i, (c, s) in enumerate(zip(';\'`,./', ':"~<>?')):
+    ascii_usage[c] = (0x33 + i, False)
+    ascii_usage[s] = (0x33 + i, True)
+
+# Macro steps are '<usage>' (tap), '+<usage>' (press), '-<usage>'
+# (release), 'w:<ms>' (wait), or 's:<text>' (type text, US layout).
+# Usages are hex.
+def parse_macro(words):
+    steps = []
+    for w in words:
+        if w.startswith('s:'):
+            for c in w[2:]:
+                if c not in ascii_usage:
+                    raise ValueError('cannot type %r' % c)
+                u, shift = ascii_usage[c]
+                if shift:
+                    steps += [(Macro.Press, 0xe1), (Macro.Tap, u),
+                              (Macro.Release, 0xe1)]
+                else:
+                    steps.append((Macro.Tap, u))
+        elif w.startswith('w:'):
+            ms = int(w[2:], 0)
+            if ms < 0 or ms > 255:
+                raise ValueError('bad delay: ' + w)
+            steps.append((Macro.Delay, ms))
+        else:
+            op = {'+': Macro.Press, '-': Macro.Release}.get(w[0], Macro.Tap)
+            u = int(w[1:] if op != Macro.Tap else w, 16)
+            if u == 0 or u > 0xe7:
+                raise ValueError('bad usage: ' + w)
+            steps.append((op, u))
+    if len(steps) > Macro.Steps - 1:
+        raise ValueError('macro too long (%u steps)' % len(steps))
+    return steps
+
+def macro_str(steps):
+    fmt = { Macro.Press: '+%02x', Macro.Release: '-%02x',
+            Macro.Tap: '%02x', Macro.Delay: 'w:%u' }
+    return ' '.join(fmt[op] % arg for op, arg in steps)
+
+def usblog_setup_str(setup):
+    bmRequestType, bRequest, wValue, wIndex, wLength = struct.unpack(
+        '<2B3H', setup)
+    s = '%02x %02x %04x %04x %04x  ' % (bmRequestType, bRequest,
+                                         wValue, wIndex, wLength)
+    typ, recip = (bmRequestType >> 5) & 3, bmRequestType & 0x1f
+    recip = USBLog.recip[recip] if recip < 4 else 'recip%u' % recip
+    if typ == 0:
+        name = (USBLog.std_req[bRequest]
+                if bRequest < len(USBLog.std_req) else None)
+        s += name if name else 'request%u' % bRequest
+        if bRequest == 6:
+            s += ' %s %u' % (USBLog.desc.get(wValue >> 8, 'type%02x'
+                                             % (wValue >> 8)),
+                             wValue & 0xff)
+        elif bRequest in [5, 9]:
+            s += ' %u' % wValue
+        elif bRequest in [1, 3]:
+            s += ' feature%u' % wValue
+        if recip != 'dev':
+            s += ' %s=%02x' % (recip, wIndex)
+    elif typ == 1:
+        s += '%s_%s if=%u' % ('Set' if bRequest & 8 else 'Get',
+                              USBLog.hid_req.get(bRequest & ~8,
+                                                 'request%u' % bRequest),
+                              wIndex)
+    else:
+        s += 'Vendor/Reserved'
+    return s
+
 def usage():
     print('Usage: samisara <cmd> <args...>', file=sys.stderr)
     print('Commands:', file=sys.stderr)
     print('  info', file=sys.stderr)
     print('  dfu <dfu_file>', file=sys.stderr)
+    print('  settle [calibrate]', file=sys.stderr)
+    print('  debounce [none|eager|deferred [<ms>]]', file=sys.stderr)
+    print('  idle [<timeout_ms>]', file=sys.stderr)
+    print('  ghost', file=sys.stderr)
+    print('  events', file=sys.stderr)
+    print('  stats [reset]', file=sys.stderr)
+    print('  latency', file=sys.stderr)
+    print('  poll [1|2|4|8|10]', file=sys.stderr)
+    print('  keymap [get|reset]', file=sys.stderr)
+    print('  keymap set <file>|<layer> <amiga_keycode> <usb_usage|fn|m<n>>',
+          file=sys.stderr)
+    print('  macro [<n> [<step>...]]', file=sys.stderr)
+    print('    <step>: <usb_usage>|+<usb_usage>|-<usb_usage>|w:<ms>|s:<text>',
+          file=sys.stderr)
+    print('  monitor', file=sys.stderr)
+    print('  usblog', file=sys.stderr)
     sys.exit(1)
 
 def main(argv):
@@ -118,6 +498,227 @@ def main(argv):
                         f' ({sami.build_date()})', tab=2)
         serial = h.get_serial_number_string()
         print_info_line('Serial', serial if serial else 'Unknown', tab=2)
+    elif cmd == 'settle':
+        if len(argv) > 1 or (len(argv) == 1 and argv[0] != 'calibrate'):
+            usage()
+        if len(argv) == 1:
+            sami.calibrate()
+        margin, max_ns, nr, measured = sami.settle()
+        print('Column Settle Times (%d calibrations):' % nr)
+        for i, m in enumerate(measured):
+            if m == 0xffff:
+                value = 'did not settle (%u ns applied)' % max_ns
+            else:
+                value = '%u ns (%u ns applied)' % (
+                    m, min(2*m + margin, max_ns))
+            print_info_line('Col%d' % (i+1), value, tab=2)
+    elif cmd == 'debounce':
+        if len(argv) > 2:
+            usage()
+        mode, eager_ms, deferred_ms = sami.debounce()
+        if len(argv) >= 1:
+            modes = {v: k for k, v in Debounce.str.items()}
+            if argv[0] not in modes:
+                usage()
+            mode = modes[argv[0]]
+            if len(argv) == 2:
+                ms = int(argv[1], 0)
+                if ms < 0 or ms > 255 or mode == Debounce.NoDebounce:
+                    usage()
+                if mode == Debounce.Eager:
+                    eager_ms = ms
+                else:
+                    deferred_ms = ms
+            if not sami.set_debounce(mode, eager_ms, deferred_ms):
+                print('Debounce configuration rejected', file=sys.stderr)
+                sys.exit(1)
+        print('Debounce:')
+        print_info_line('Mode', Debounce.str[mode], tab=2)
+        print_info_line('Eager', '%u ms lockout' % eager_ms, tab=2)
+        print_info_line('Deferred', '%u ms stable' % deferred_ms, tab=2)
+    elif cmd == 'idle':
+        if len(argv) > 1:
+            usage()
+        if len(argv) == 1:
+            timeout_ms = int(argv[0], 0)
+            if timeout_ms < 0 or timeout_ms > 65535:
+                usage()
+            sami.set_idle_timeout(timeout_ms)
+        timeout_ms, nr_wakeups = sami.idle()
+        print('Idle:')
+        print_info_line('Timeout', ('%u ms' % timeout_ms) if timeout_ms
+                        else 'Never', tab=2)
+        print_info_line('Wakeups', '%u' % nr_wakeups, tab=2)
+    elif cmd == 'ghost':
+        if len(argv) != 0:
+            usage()
+        nr_detected, nr_held = sami.ghost()
+        print('Ghost Keys:')
+        print_info_line('Detected', '%u' % nr_detected, tab=2)
+        print_info_line('Held', '%u' % nr_held, tab=2)
+    elif cmd == 'events':
+        if len(argv) != 0:
+            usage()
+        nr_slots, depth, max_depth, nr_events, nr_overflows = sami.events()
+        print('Key Event Queue:')
+        print_info_line('Depth', '%u/%u (max %u)'
+                        % (depth, nr_slots, max_depth), tab=2)
+        print_info_line('Events', '%u' % nr_events, tab=2)
+        print_info_line('Overflows', '%u' % nr_overflows, tab=2)
+    elif cmd == 'stats':
+        if len(argv) > 1 or (len(argv) == 1 and argv[0] != 'reset'):
+            usage()
+        if len(argv) == 1:
+            sami.reset_stats()
+            return
+        region, nr_regions = 0, 1
+        while region < nr_regions:
+            s = sami.stats(region)
+            nr_regions = s['nr_regions']
+            region += 1
+            mhz, count = s['mhz'], s['count']
+            def cyc(c):
+                return '%u (%.2fus)' % (c, c / mhz)
+            print('%s:' % s['name'])
+            print_info_line('Count', '%u' % count, tab=2)
+            if count == 0:
+                continue
+            print_info_line('Min', cyc(s['min']), tab=2)
+            print_info_line('Mean', cyc(s['total'] // count), tab=2)
+            print_info_line('Max', cyc(s['max']), tab=2)
+            peak = max(s['hist'])
+            for b, n in enumerate(s['hist']):
+                if n == 0:
+                    continue
+                lo = 0 if b == 0 else 1 << (b + s['shift'])
+                bar = '#' * max(1, (40 * n) // peak)
+                print('    >=%-7u %-40s %u' % (lo, bar, n))
+    elif cmd == 'latency':
+        if len(argv) != 0:
+            usage()
+        nr_events, nr_samples, stages = sami.latency()
+        print('Keypress Latency (%u of %u events):' % (nr_samples, nr_events))
+        print('  %-10s %10s %10s %10s' % ('', 'p50', 'p99', 'max'))
+        for name, (p50, p99, pmax) in zip(['Queued', 'Collected', 'Total'],
+                                          stages):
+            print('  %-10s %8uus %8uus %8uus' % (name + ':', p50, p99, pmax))
+    elif cmd == 'poll':
+        if len(argv) > 1 or (len(argv) == 1
+                             and argv[0] not in ['1', '2', '4', '8', '10']):
+            usage()
+        if len(argv) == 1 and int(argv[0]) != sami.poll():
+            # The device re-enumerates: it will not answer further requests.
+            sami.set_poll(int(argv[0]))
+            print('Polling Interval: %s ms (re-enumerating)' % argv[0])
+            return
+        print('Polling Interval: %u ms' % sami.poll())
+    elif cmd == 'keymap':
+        if len(argv) == 0 or argv == ['get']:
+            for layer in range(Keymap.Layers):
+                for key, u in enumerate(sami.keymap(layer)):
+                    print('%u %02x %s' % (layer, key, keymap_usage_str(u)))
+        elif argv == ['reset']:
+            # Macros and the poll interval are not affected.
+            sami.reset_config(Config.Keymap)
+            sami.save_config()
+        elif argv[0] == 'set' and len(argv) in [2, 4]:
+            try:
+                if len(argv) == 4:
+                    entries = [parse_keymap_entry(argv[1:])]
+                else:
+                    with open(argv[1], 'r') as f:
+                        lines = [l.split('#')[0].split() for l in f]
+                    entries = [parse_keymap_entry(w) for w in lines if w]
+            except ValueError as e:
+                print(e, file=sys.stderr)
+                sys.exit(1)
+            keymap = [sami.keymap(layer) for layer in range(Keymap.Layers)]
+            for layer, key, u in entries:
+                keymap[layer][key] = u
+            for layer in range(Keymap.Layers):
+                if not sami.set_keymap(layer, 0, keymap[layer]):
+                    print('Keymap rejected', file=sys.stderr)
+                    sys.exit(1)
+            sami.save_config()
+        else:
+            usage()
+    elif cmd == 'macro':
+        if len(argv) == 0:
+            for idx in range(Macro.Nr):
+                print('m%u: %s' % (idx, macro_str(sami.macro(idx))))
+            return
+        idx = int(argv[0], 0)
+        if idx < 0 or idx >= Macro.Nr:
+            usage()
+        if len(argv) > 1:
+            try:
+                steps = parse_macro(argv[1:])
+            except ValueError as e:
+                print(e, file=sys.stderr)
+                sys.exit(1)
+            if not sami.set_macro(idx, steps):
+                print('Macro rejected', file=sys.stderr)
+                sys.exit(1)
+            sami.save_config()
+        print('m%u: %s' % (idx, macro_str(sami.macro(idx))))
+    elif cmd == 'monitor':
+        if len(argv) != 0:
+            usage()
+        # Timestamps (32 bits) and counters (16 bits) wrap: extend them.
+        prev_seq, t0, t_prev, t_ext, counters = None, None, 0, 0, {}
+        try:
+            for seq, dropped, mhz, recs in sami.telemetry():
+                if prev_seq is not None and seq != (prev_seq + 1) & 0xff:
+                    print('** %u reports lost' % ((seq - prev_seq - 1) & 0xff))
+                prev_seq = seq
+                if dropped:
+                    print('** %u%s records dropped'
+                          % (dropped, '+' if dropped == 255 else ''))
+                for t, typ, idx, val in recs:
+                    # Signed: records are not strictly in time order.
+                    t_ext += ((t - t_prev + (1<<31)) & 0xffffffff) - (1<<31)
+                    t_prev = t
+                    if t0 is None:
+                        t0 = t_ext
+                    ts = '%12.6f' % ((t_ext - t0) / (mhz * 1000000))
+                    if typ == Telemetry.Key:
+                        print('%s key %02x %s' % (ts, idx, 'down' if val
+                                                  else 'up'))
+                    elif typ == Telemetry.Counter:
+                        c = counters.get(idx, val)
+                        c += (val - c) & 0xffff
+                        counters[idx] = c
+                        name = (Telemetry.counters[idx]
+                                if idx < len(Telemetry.counters)
+                                else 'counter%u' % idx)
+                        print('%s %s = %u' % (ts, name, c))
+                    elif typ == Telemetry.Error:
+                        name = (Telemetry.errors[idx]
+                                if idx < len(Telemetry.errors)
+                                else 'error%u' % idx)
+                        print('%s ERROR: %s (%u)' % (ts, name, val))
+        except KeyboardInterrupt:
+            pass
+    elif cmd == 'usblog':
+        if len(argv) != 0:
+            usage()
+        mhz, recs = sami.usblog()
+        # Timestamps (32 bits) wrap: accumulate the deltas between records.
+        t_prev, t_ext = recs[0][0] if recs else 0, 0
+        for t, typ, dat in recs:
+            dt = (t - t_prev) & 0xffffffff
+            t_prev, t_ext = t, t_ext + dt
+            ts = '%12.6f %+10.6f' % (t_ext / (mhz * 1e6), dt / (mhz * 1e6))
+            name = USBLog.str.get(typ, 'type%u' % typ)
+            if typ == USBLog.Setup:
+                print('%s %-8s %s' % (ts, name, usblog_setup_str(dat)))
+            elif typ in [USBLog.In, USBLog.Out]:
+                ep, length = struct.unpack('<BH', dat[:3])
+                print('%s %-8s ep%02x %u bytes' % (ts, name, ep, length))
+            elif typ in [USBLog.Status, USBLog.Stall]:
+                print('%s %-8s ep%02x' % (ts, name, dat[0]))
+            else:
+                print('%s %s' % (ts, name))
     elif cmd == 'dfu':
         if len(argv) != 1:
             usage()
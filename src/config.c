@@ -0,0 +1,111 @@
+/*
+ * config.c
+ * 
+ * Persistent configuration, saved in flash.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* The final 2kB of the 64kB flash window is excluded from the firmware
+ * image (see target.ld.S). It holds a header, struct config as saved, and a
+ * CRC over both. */
+#define CONFIG_ADDR  0x0800f800
+#define CONFIG_AREA  2048
+#define CONFIG_MAGIC 0x5343
+
+struct packed config_hdr {
+    uint16_t magic;
+    uint16_t size; /* sizeof(struct config) when saved */
+};
+
+struct config config;
+
+static void config_defaults(struct config *c, uint8_t sections)
+{
+    if (sections & SAMISARA_CONFIG_KEYMAP)
+        keyboard_default_keymap(c);
+    if (sections & SAMISARA_CONFIG_MACROS)
+        memset(c->macro, 0, sizeof(c->macro));
+    if (sections & SAMISARA_CONFIG_POLL)
+        c->poll_ms = 10;
+}
+
+/* Return the size of the saved configuration, or 0 if there is none. */
+static unsigned int config_saved(void)
+{
+    const struct config_hdr *hdr = (const struct config_hdr *)CONFIG_ADDR;
+    uint16_t crc;
+
+    if ((hdr->magic != CONFIG_MAGIC)
+        || (hdr->size > CONFIG_AREA - sizeof(*hdr) - sizeof(crc)))
+        return 0;
+
+    memcpy(&crc, (const uint8_t *)(hdr+1) + hdr->size, sizeof(crc));
+    if (crc16_ccitt(hdr, sizeof(*hdr) + hdr->size, 0xffff) != crc)
+        return 0;
+
+    return hdr->size;
+}
+
+void config_init(void)
+{
+    unsigned int size = config_saved();
+
+    memset(&config, 0, sizeof(config));
+    config_defaults(&config, SAMISARA_CONFIG_ALL);
+    memcpy(&config, (const struct config_hdr *)CONFIG_ADDR + 1,
+           min_t(unsigned int, size, sizeof(config)));
+
+    printk("Config: %s\n", size ? "Loaded" : "Defaults");
+}
+
+void config_save(void)
+{
+    struct config_hdr hdr = { .magic = CONFIG_MAGIC, .size = sizeof(config) };
+    uint32_t addr;
+    uint16_t crc;
+
+    /* fpec_write() writes halfwords. */
+    BUILD_BUG_ON(sizeof(config) & 1);
+    BUILD_BUG_ON(sizeof(hdr) + sizeof(config) + sizeof(crc) > CONFIG_AREA);
+
+    /* Avoid needless flash wear. */
+    if ((config_saved() == sizeof(config))
+        && !memcmp(&config, (const struct config_hdr *)CONFIG_ADDR + 1,
+                   sizeof(config)))
+        return;
+
+    crc = crc16_ccitt(&hdr, sizeof(hdr), 0xffff);
+    crc = crc16_ccitt(&config, sizeof(config), crc);
+
+    fpec_init();
+    for (addr = CONFIG_ADDR; addr < CONFIG_ADDR + CONFIG_AREA;
+         addr += FLASH_PAGE_SIZE)
+        fpec_page_erase(addr);
+    addr = CONFIG_ADDR;
+    fpec_write(&hdr, sizeof(hdr), addr);
+    addr += sizeof(hdr);
+    fpec_write(&config, sizeof(config), addr);
+    addr += sizeof(config);
+    fpec_write(&crc, sizeof(crc), addr);
+
+    printk("Config: Saved\n");
+}
+
+void config_reset(uint8_t sections)
+{
+    config_defaults(&config, sections);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -9,187 +9,1396 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
+/* Matrix layout, pin assignments, and keycode translation tables. */
+#include "scan_tables.h"
+
 static bool_t initialised;
 static int count;
 
-/* Rows 1-6: PA0-5 */
-#define gpio_row gpioa
+/* Time allowed for the rows to settle after a column is driven low. This is
+ * calibrated per column, with the following safety margin and upper bound. */
+#define SETTLE_MARGIN_NS 1000
+#define SETTLE_MAX_US 20
 
-struct a1200_column {
-    uint8_t code[6];
-    uint8_t gpio;
-    uint8_t pin;
-};
+/* Period of a complete matrix scan. Scans start at fixed intervals
+ * regardless of how long each scan takes to complete. */
+#define SCAN_PERIOD_US 1000
+
+/* Scan the matrix by DMA, paced by a hardware timer, rather than by
+ * timer callbacks. Enabled by building with scan_dma=y. */
+#ifndef SCAN_DMA
+#define SCAN_DMA 0
+#endif
 
-#define NA 0xff
-
-const static struct a1200_column a1200_matrix[15] = {
-    { { 0x45, 0x00, 0x42, 0x62, 0x30, 0x5d }, _B, 15 },
-    { { 0x5a, 0x01, 0x10, 0x20, 0x31, 0x5e }, _B, 14 },
-    { { 0x50, 0x02, 0x11, 0x21, 0x32, 0x3f }, _B, 13 },
-    { { 0x51, 0x03, 0x12, 0x22, 0x33, 0x2f }, _B, 12 },
-    { { 0x52, 0x04, 0x13, 0x23, 0x34, 0x1f }, _B, 11 },
-    { { 0x53, 0x05, 0x14, 0x24, 0x35, 0x3c }, _B, 10 },
-    { { 0x54, 0x06, 0x15, 0x25, 0x36, 0x3e }, _B,  9 },
-    { { 0x5b, 0x07, 0x16, 0x26, 0x37, 0x2e }, _B,  8 },
-    { { 0x55, 0x08, 0x17, 0x27, 0x38, 0x1e }, _B,  7 },
-    { { 0x5c, 0x09, 0x18, 0x28, 0x39, 0x43 }, _B,  6 },
-    { { 0x56, 0x0a, 0x19, 0x29, 0x3a, 0x3d }, _B,  5 },
-    { { 0x57, 0x0b, 0x1a, 0x2a, NA,   0x2d }, _B,  4 },
-    { { 0x58, 0x0c, 0x1b, 0x2b, 0x40, 0x1d }, _B,  3 },
-    { { 0x59, 0x0d, 0x44, 0x46, 0x41, 0x0f }, _B,  1 },
-    { { 0x5f, 0x4c, 0x4f, 0x4e, 0x4d, 0x4a }, _B,  0 }
+/* The USB reports are updated incrementally, as keys are pressed and
+ * released. The Report Protocol sends an N-key rollover bitmap. The Boot
+ * Protocol sends the standard 6KRO report, in which more than six
+ * non-modifier keys pressed is reported as the Phantom state. */
+#define NKRO_BYTES ((0xe7 + 1) / 8)
+struct usb_report {
+    uint8_t boot[8];
+    uint8_t nkro[NKRO_BYTES]; /* Bitmap of usages 0x00-0xE7 */
+    unsigned int nr_codes; /* Non-modifier keys pressed, including overflow */
+    uint8_t protocol;      /* Protocol of the most recent report sent */
+    bool_t dirty;          /* Not yet sent to the host */
 };
 
-struct special_key {
-    uint8_t code;
-    uint8_t gpio;
-    uint8_t pin;
+static struct usb_report report;
+
+/* HID idle rate. Unless zero, the keyboard report is repeated whenever it
+ * has not been sent for the idle period. */
+static struct repeat {
+    struct timer timer;
+    uint8_t idle_rate;     /* Rate in effect, in units of 4ms */
+    volatile bool_t due;   /* Idle period has expired */
+} repeat;
+
+/* Matrix state captured by one complete scan. Bits are set for pressed
+ * keys: bit n of rows[] is Row n+1; special is a sample of the special-key
+ * pins (gpio_special0 in bits 0-15, gpio_special1 in bits 16-31). */
+struct matrix_snapshot {
+    uint8_t rows[NR_COLS];
+    uint32_t special;
+    time_t time;      /* Time at which the scan started */
 };
 
-const static struct special_key special_key[7] = {
-    { 0x61, _A,  6 }, /* R.Shift */
-    { 0x65, _A,  7 }, /* R.Alt */
-    { 0x67, _A,  8 }, /* R.Amiga */
-    { 0x63, _C, 13 }, /* Ctrl */
-    { 0x60, _C, 15 }, /* L.Shift */
-    { 0x64, _C, 14 }, /* L.Alt */
-    { 0x66, _A, 15 }  /* L.Amiga */
+/* The matrix has no per-key diodes: three keys pressed at the corners of a
+ * rectangle of columns and rows also pull down the fourth corner. Any two
+ * columns sharing two or more pressed rows form such a rectangle, and all
+ * its corners are ambiguous. New presses on ambiguous keys are held back
+ * until the ambiguity is resolved; keys already pressed remain so. */
+static struct ghost {
+    uint8_t rows[NR_COLS]; /* Filtered rows of the previous scan */
+    uint8_t held[NR_COLS]; /* Keys currently held back */
+    bool_t active;         /* Rectangle present in the previous scan */
+    uint32_t nr_detected;  /* Rectangles detected */
+    uint32_t nr_held;      /* Key presses held back */
+} ghost;
+
+/* Key state is held in bitmaps indexed by Amiga keycode. */
+#define KEY_WORDS (NR_KEYS/32)
+
+/* Each key's USB usage is looked up in the keymap (held in the
+ * configuration) when it is pressed, and latched until it is released. A
+ * release therefore matches its press even if the keymap or layer changes
+ * in between. */
+static struct keymap {
+    uint8_t code[NR_KEYS]; /* Latched usage of each pressed key */
+    uint8_t nr_fn;         /* FN keys held: Layer 1 applies if non-zero */
+} keymap;
+
+/* Macro playback has its own report, sent in place of the keyboard report
+ * one step at a time, each as soon as the host has collected the previous
+ * one. Key events are still applied to the keyboard report meanwhile, and
+ * it is sent once playback ends. Delay steps run on a timer, so that
+ * nothing blocks. */
+static struct macro {
+    struct usb_report report;
+    struct timer timer;
+    volatile bool_t delay; /* Delay step in progress */
+    bool_t playing;
+    bool_t tap;            /* Release of the previous TAP step is due */
+    uint8_t idx, step;     /* Next step to play */
+} macro;
+
+/* Key events pass from the debouncer to the USB report sender through a
+ * single-producer/single-consumer ring. Each index is written only by its
+ * owner, so no lock is needed. The sender consumes queued events a batch
+ * at a time, one batch per report, so that no transition is lost. If the
+ * ring fills, further edges are left pending (@backlog) until there is
+ * space: intermediate transitions may be lost, but not the final state. */
+#define NR_EVENTS 32
+struct key_event {
+    time_t time;      /* Start of the first scan which saw the edge */
+    uint8_t key;      /* Amiga keycode */
+    uint8_t pressed;
 };
+static struct events {
+    struct key_event ring[NR_EVENTS];
+    uint16_t prod, cons;   /* Free-running producer/consumer indexes */
+    uint32_t queued[KEY_WORDS]; /* Key state after all queued events */
+    bool_t backlog;        /* Edges not queued due to a full ring */
+    uint16_t max_depth;
+    uint32_t nr_events;
+    uint32_t nr_overflows;
+} events;
 
-const static uint8_t a1200_usb_map[] = {
-    0x35, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, /* 00-07 */
-    0x25, 0x26, 0x27, 0x2d, 0x2e, 0x31, NA,   0x62, /* 08-0f */
-    0x14, 0x1a, 0x08, 0x15, 0x17, 0x1c, 0x18, 0x0c, /* 10-17 */
-    0x12, 0x13, 0x2f, 0x30, NA,   0x59, 0x5a, 0x5b, /* 18-1f */
-    0x04, 0x16, 0x07, 0x09, 0x0a, 0x0b, 0x0d, 0x0e, /* 20-27 */
-    0x0f, 0x33, 0x34, 0x32, NA,   0x5c, 0x5d, 0x5e, /* 28-2f */
-    0x64, 0x1d, 0x1b, 0x06, 0x19, 0x05, 0x11, 0x10, /* 30-37 */
-    0x36, 0x37, 0x38, NA,   0x63, 0x5f, 0x60, 0x61, /* 38-3f */
-    0x2c, 0x2a, 0x2b, 0x58, 0x28, 0x29, 0x4c, NA,   /* 40-47 */
-    NA,   NA,   0x56, NA,   0x52, 0x51, 0x4f, 0x50, /* 48-4f */
-    0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, /* 50-57 */
-    0x42, 0x43, 0x53, 0x47, 0x54, 0x55, 0x57, 0x49, /* 58-5f */
-    0xe1, 0xe5, 0x39, 0xe0, 0xe2, 0xe6, 0xe3, 0xe7, /* 60-67 */
+/* Keypress latency trace. Each key event records the time of the first
+ * scan which saw its raw edge, when the report carrying it was queued, and
+ * when the host collected that report. Entries [batch, prod) belong to the
+ * report being built or awaiting collection; those before are complete. */
+#define NR_TRACE 64
+static struct trace {
+    struct trace_entry {
+        time_t scan, queued, done;
+    } ring[NR_TRACE];
+    uint16_t prod, batch;  /* Free-running indexes */
+    bool_t in_flight;      /* Batch queued, awaiting collection */
+    uint32_t nr_events;    /* Entries completed since reset */
+} trace;
+
+/* Default debounce configuration. */
+#define DEBOUNCE_MODE SAMISARA_DEBOUNCE_EAGER
+#define DEBOUNCE_EAGER_MS 5
+#define DEBOUNCE_DEFERRED_MS 5
+
+/* Per-key debounce. Each key within a debounce period is marked in @timing,
+ * with the start of the period in @t[]. Edges are not reported for such
+ * keys. In Eager mode the period is a lockout which starts when an edge is
+ * reported; in Deferred mode it starts at every raw edge, so that a key is
+ * reported only once it has been stable for the entire period. The first
+ * raw sample of each transition not yet reported is recorded in @edge[], so
+ * that latency is measured from the matrix rather than from the end of the
+ * debounce period. */
+static struct debounce {
+    struct samisara_cmd_debounce conf;
+    uint32_t raw[KEY_WORDS];    /* Most recent raw key state */
+    uint32_t state[KEY_WORDS];  /* Debounced key state */
+    uint32_t timing[KEY_WORDS]; /* Keys within a debounce period */
+    time_t t[NR_KEYS];          /* Start of each key's debounce period */
+    time_t edge[NR_KEYS];       /* First raw sample of each transition */
+} debounce = {
+    .conf = {
+        .mode = DEBOUNCE_MODE,
+        .eager_ms = DEBOUNCE_EAGER_MS,
+        .deferred_ms = DEBOUNCE_DEFERRED_MS
+    }
 };
 
-struct usb_report {
-    uint8_t buf[8];
-    unsigned int nr_codes;
+/* The scan engine runs in timer-callback context. It strobes one column at
+ * a time, and samples the rows on expiry of the column's settle deadline.
+ * The main loop is therefore free to service USB throughout the scan. */
+static struct scan {
+    struct timer timer;
+    time_t start;     /* Start time of the current scan cycle */
+    uint8_t col;      /* Column currently strobed, NR_COLS if none */
+    struct matrix_snapshot cur;  /* Scan in progress */
+    struct matrix_snapshot done; /* Most recent complete scan */
+    uint32_t seq;     /* Incremented on each update of @done */
+    uint16_t settle[NR_COLS]; /* Per-column settle time, in time ticks */
+} scan;
+
+/* Results of the most recent settle-time calibration, in time ticks. */
+#define SETTLE_TIMEOUT 0xffffu
+static struct calibration {
+    uint16_t measured[NR_COLS];
+    uint16_t nr;
+} calibration;
+static uint32_t last_seq;
+
+/* Idle mode: Scanning stops and all columns are driven low, so that any
+ * keypress pulls a row or special-key pin low and raises an EXTI interrupt.
+ * Entered once the matrix has been empty for @timeout_ms, or immediately
+ * while the USB bus is suspended. When suspended, the CPU is also slowed
+ * for as long as the matrix is idle, and any key activity wakes the host. */
+#define IDLE_TIMEOUT_MS 1000
+static struct idle {
+    struct timer timer;   /* Polls special keys which have no EXTI line */
+    time_t last_active;   /* Time of the most recent non-empty scan */
+    uint16_t timeout_ms;  /* 0: Never enter idle mode */
+    volatile bool_t active;
+    bool_t suspended;     /* USB bus suspended */
+    bool_t slow;          /* clock_slow() in effect */
+    uint32_t nr_wakeups;
+} idle = {
+    .timeout_ms = IDLE_TIMEOUT_MS
 };
 
-static struct usb_report last_report;
+/* EXTI wake interrupts: EXTI0-4, EXTI9_5, EXTI15_10. */
+void IRQ_6(void) __attribute__((alias("IRQ_idle_wake")));
+void IRQ_7(void) __attribute__((alias("IRQ_idle_wake")));
+void IRQ_8(void) __attribute__((alias("IRQ_idle_wake")));
+void IRQ_9(void) __attribute__((alias("IRQ_idle_wake")));
+void IRQ_10(void) __attribute__((alias("IRQ_idle_wake")));
+void IRQ_23(void) __attribute__((alias("IRQ_idle_wake")));
+void IRQ_40(void) __attribute__((alias("IRQ_idle_wake")));
+static const uint8_t exti_irqs[] = { 6, 7, 8, 9, 10, 23, 40 };
+
+static void scan_timer_fn(void *unused);
+static void scan_start(void);
+static void scan_stop(void);
+
+/* The DMA scan engine is paced by TIM3. At each update event DMA1 Ch3
+ * (TIM3_UP) writes the next word of col_dma_bsrr[] to the column BSRR:
+ * releasing the current column and strobing the next. Just before each
+ * update event DMA1 Ch6 (TIM3_CH1) captures the rows from the row IDR into
+ * the next entry of @idr. The capture ring holds two complete scans: the
+ * CPU reads whichever half is not being filled. */
+#define scan_tim tim3
+#define dma_col dma1->ch3
+#define dma_row dma1->ch6
+#define DMA_ROW_CH 6
+#define DMA_ROW_IRQ 16
+void IRQ_16(void) __attribute__((alias("IRQ_dma_scan")));
+static struct dma_scan {
+    uint16_t idr[2*NR_COLS];
+} dma_scan;
+
+static void dma_scan_start(void);
+static void dma_scan_stop(void);
+static void scan_calibrate(void);
+static void idle_poll_fn(void *unused);
+static void macro_timer_fn(void *unused);
+static void repeat_timer_fn(void *unused);
+
+static void configure_pins(GPIO gpio, uint16_t mask, unsigned int mode)
+{
+    unsigned int i;
+    for (i = 0; i < 16; i++) {
+        if (mask & 1)
+            gpio_configure_pin(gpio, i, mode);
+        mask >>= 1;
+    }
+}
 
 void keyboard_init(void)
 {
-    int i;
+    unsigned int i;
 
     /* Rows */
-    for (i = 0; i < 6; i++)
-        gpio_configure_pin(gpio_row, i, GPI_floating);
+    configure_pins(gpio_row, ROW_MASK, GPI_floating);
 
     /* Special keys */
-    for (i = 0; i < ARRAY_SIZE(special_key); i++) {
-        const struct special_key *sk = &special_key[i];
-        gpio_configure_pin(gpio_from_id(sk->gpio), sk->pin, GPI_floating);
-    }
+    configure_pins(gpio_special0, SPECIAL0_MASK, GPI_floating);
+    configure_pins(gpio_special1, SPECIAL1_MASK, GPI_floating);
 
     /* Columns */
-    for (i = 0; i < ARRAY_SIZE(a1200_matrix); i++) {
-        const struct a1200_column *col = &a1200_matrix[i];
-        gpio_configure_pin(gpio_from_id(col->gpio), col->pin,
-                           GPO_opendrain(IOSPD_LOW, HIGH));
-    }
+    configure_pins(gpio_col, COL_MASK, GPO_opendrain(IOSPD_LOW, HIGH));
 
     /* Caps Lock */
     gpio_configure_pin(gpiob, 2, GPO_pushpull(IOSPD_LOW, LOW));
+
+    /* EXTI wake sources for idle mode. */
+    afio->exticr1 = exticr[0];
+    afio->exticr2 = exticr[1];
+    afio->exticr3 = exticr[2];
+    afio->exticr4 = exticr[3];
+    exti->imr &= ~EXTI_MASK;
+    exti->ftsr |= EXTI_MASK;
+    exti->pr = EXTI_MASK;
+    for (i = 0; i < ARRAY_SIZE(exti_irqs); i++) {
+        IRQx_set_prio(exti_irqs[i], TIMER_IRQ_PRI);
+        IRQx_enable(exti_irqs[i]);
+    }
+    if (SCAN_DMA) {
+        IRQx_set_prio(DMA_ROW_IRQ, TIMER_IRQ_PRI);
+        IRQx_enable(DMA_ROW_IRQ);
+    }
+    timer_init(&idle.timer, idle_poll_fn, NULL);
+
+    /* Start the scan engine. */
+    timer_init(&scan.timer, scan_timer_fn, NULL);
+    timer_init(&macro.timer, macro_timer_fn, NULL);
+    timer_init(&repeat.timer, repeat_timer_fn, NULL);
+    scan_calibrate();
+    scan_start();
+}
+
+static void scan_start(void)
+{
+    if (SCAN_DMA) {
+        dma_scan_start();
+    } else {
+        scan.col = NR_COLS;
+        scan.start = time_now();
+        timer_set(&scan.timer, scan.start);
+    }
+}
+
+static void scan_stop(void)
+{
+    if (SCAN_DMA) {
+        dma_scan_stop();
+    } else {
+        timer_cancel(&scan.timer);
+        scan.col = NR_COLS;
+    }
+    gpio_col->bsrr = COL_MASK; /* release all columns */
+}
+
+static void column_strobe(unsigned int i)
+{
+    gpio_col->bsrr = col_strobe_bsrr[i];
+}
+
+static void column_release(unsigned int i)
+{
+    gpio_col->bsrr = col_release_bsrr[i];
+}
+
+static uint32_t special_keys_read(void)
+{
+    return (~gpio_special0->idr & SPECIAL0_MASK)
+        | ((~gpio_special1->idr & SPECIAL1_MASK) << 16);
+}
+
+static void scan_step(void)
+{
+    if (scan.col < NR_COLS) {
+        /* Rows have settled: sample them and release the column. */
+        scan.cur.rows[scan.col] = ~gpio_row->idr & ROW_MASK;
+        column_release(scan.col);
+        scan.col++;
+    } else {
+        /* Start of a new scan cycle. */
+        scan.col = 0;
+        scan.cur.time = scan.start;
+    }
+
+    if (scan.col < NR_COLS) {
+        /* Strobe the next column and wait for the rows to settle. */
+        column_strobe(scan.col);
+        timer_set(&scan.timer, time_now() + scan.settle[scan.col]);
+        return;
+    }
+
+    /* Scan cycle complete. Publish the snapshot. */
+    scan.cur.special = special_keys_read();
+    scan.done = scan.cur;
+    scan.seq++;
+    work_post(WORK_KEYBOARD);
+
+    /* Schedule the next cycle. If we have fallen behind (eg. a long
+     * higher-priority interrupt) then resynchronise to the current time. */
+    scan.start = time_add(scan.start, time_us(SCAN_PERIOD_US));
+    if (time_since(scan.start) > 0)
+        scan.start = time_now();
+    timer_set(&scan.timer, scan.start);
+}
+
+static void scan_timer_fn(void *unused)
+{
+    uint32_t t = stats_start();
+    scan_step();
+    stats_end(STATS_SCAN_STEP, t);
+}
+
+/* Leave idle mode and resume scanning. Called in IRQ context at
+ * TIMER_IRQ_PRI, or with that priority level masked. */
+static void idle_exit(void)
+{
+    exti->imr &= ~EXTI_MASK;
+    exti->pr = EXTI_MASK;
+    timer_cancel(&idle.timer);
+
+    gpio_col->bsrr = COL_MASK; /* release all columns */
+    idle.last_active = time_now();
+    idle.nr_wakeups++;
+    idle.active = FALSE;
+    scan_start();
+}
+
+static void idle_enter(void)
+{
+    uint32_t oldpri;
+
+    scan_stop();
+
+    /* Drive all columns low and arm the wake sources. */
+    gpio_col->bsrr = COL_MASK << 16;
+    exti->pr = EXTI_MASK;
+    exti->imr |= EXTI_MASK;
+    idle.active = TRUE;
+    if (IDLE_POLL_MASK)
+        timer_set(&idle.timer, time_add(time_now(),
+                                        time_us(SCAN_PERIOD_US)));
+
+    /* A key pressed before the wake sources were armed raises no edge:
+     * check for one now. */
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    if (idle.active && ((~gpio_row->idr & ROW_MASK) || special_keys_read()))
+        idle_exit();
+    IRQ_restore(oldpri);
+}
+
+/* Special keys with no EXTI line are polled at the scan rate, so that they
+ * incur no extra latency. */
+static void idle_poll_fn(void *unused)
+{
+    if (special_keys_read() & IDLE_POLL_MASK) {
+        idle_exit();
+        return;
+    }
+    timer_set(&idle.timer, time_add(idle.timer.deadline,
+                                    time_us(SCAN_PERIOD_US)));
+}
+
+static void IRQ_idle_wake(void)
+{
+    exti->pr = EXTI_MASK;
+    if (idle.active)
+        idle_exit();
+}
+
+void keyboard_set_idle_timeout(uint16_t timeout_ms)
+{
+    idle.last_active = time_now();
+    idle.timeout_ms = timeout_ms;
+}
+
+void keyboard_get_idle(struct samisara_subreport_idle *s)
+{
+    s->timeout_ms = idle.timeout_ms;
+    s->nr_wakeups = idle.nr_wakeups;
+}
+
+static unsigned int ns_to_ticks(unsigned int ns)
+{
+    return (ns * TIME_MHZ + 999u) / 1000u;
+}
+
+static unsigned int ticks_to_ns(unsigned int ticks)
+{
+    return (ticks * 1000u) / TIME_MHZ;
+}
+
+/* Sample the rows, and the column lines in @col_mask, for @timeout ticks
+ * from @t0. Returns the time of the last change and the final sample. */
+static uint16_t settle_measure(uint32_t col_mask, time_t t0,
+                               unsigned int timeout, uint32_t *p_final)
+{
+    uint32_t x, prev = ~0u;
+    time_t t, last = t0;
+
+    do {
+        x = (gpio_row->idr & ROW_MASK) | ((gpio_col->idr & col_mask) << 16);
+        t = time_now();
+        if (x != prev) {
+            prev = x;
+            last = t;
+        }
+    } while (time_diff(t0, t) < timeout);
+
+    *p_final = x;
+    return time_diff(t0, last);
+}
+
+/* Measure the time for the rows to return high through their pull-ups.
+ * This is the slowest edge seen by the scan (a row released by a key in
+ * the previous column) but, unlike the column edges, it can be measured
+ * without any key held down: Drive all rows low, then release them. */
+static uint16_t row_rise_measure(unsigned int timeout)
+{
+    uint32_t final;
+    uint16_t rise;
+    time_t t0;
+
+    configure_pins(gpio_row, ROW_MASK, GPO_opendrain(IOSPD_LOW, LOW));
+    delay_us(1);
+    t0 = time_now();
+    configure_pins(gpio_row, ROW_MASK, GPI_floating);
+    rise = settle_measure(0, t0, timeout, &final);
+    if (final != ROW_MASK) /* rows did not go high */
+        rise = SETTLE_TIMEOUT;
+
+    return rise;
+}
+
+/* Measure each column's settle time: Strobe the column and wait for it, and
+ * the rows, to stop changing; then release the column and wait for it, and
+ * all rows, to return high. Each column is allowed no less than the row
+ * rise time, which bounds the settle time of a column with keys pressed
+ * even if none are held down during calibration. */
+static void scan_calibrate(void)
+{
+    unsigned int i, timeout = time_us(SETTLE_MAX_US);
+    uint32_t flags, col_mask, final;
+    uint16_t fall, rise, row_rise;
+    time_t t0;
+
+    IRQ_global_save(flags);
+    row_rise = row_rise_measure(timeout);
+    IRQ_global_restore(flags);
+
+    for (i = 0; i < NR_COLS; i++) {
+
+        col_mask = col_release_bsrr[i];
+
+        IRQ_global_save(flags);
+
+        t0 = time_now();
+        column_strobe(i);
+        fall = settle_measure(col_mask, t0, timeout, &final);
+        if (final >> 16) /* column did not go low */
+            fall = SETTLE_TIMEOUT;
+
+        t0 = time_now();
+        column_release(i);
+        rise = settle_measure(col_mask, t0, timeout, &final);
+        if (final != (ROW_MASK | (col_mask << 16))) /* lines did not go high */
+            rise = SETTLE_TIMEOUT;
+
+        IRQ_global_restore(flags);
+
+        rise = max(rise, row_rise);
+        calibration.measured[i] = max(fall, rise);
+        scan.settle[i] = (calibration.measured[i] == SETTLE_TIMEOUT)
+            ? timeout
+            : min_t(unsigned int, timeout,
+                    2*calibration.measured[i]
+                    + ns_to_ticks(SETTLE_MARGIN_NS));
+        if (calibration.measured[i] == SETTLE_TIMEOUT)
+            telemetry_log(SAMISARA_TELEMETRY_ERROR, SAMISARA_ERROR_SETTLE,
+                          i, t0);
+    }
+
+    calibration.nr++;
+}
+
+void keyboard_calibrate(void)
+{
+    uint32_t oldpri;
+
+    /* Calibration drives the columns: leave idle mode first. */
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    if (idle.active)
+        idle_exit();
+    IRQ_restore(oldpri);
+
+    scan_stop();
+    scan_calibrate();
+    scan_start();
+}
+
+void keyboard_get_settle(struct samisara_subreport_settle *settle)
+{
+    unsigned int i;
+    uint16_t t;
+
+    settle->margin_ns = SETTLE_MARGIN_NS;
+    settle->max_ns = SETTLE_MAX_US * 1000;
+    settle->nr_calibrations = calibration.nr;
+    for (i = 0; i < NR_COLS; i++) {
+        t = calibration.measured[i];
+        settle->measured_ns[i] = (t == SETTLE_TIMEOUT)
+            ? SETTLE_TIMEOUT : ticks_to_ns(t);
+    }
+}
+
+static void dma_scan_start(void)
+{
+    unsigned int i, settle_us = 1;
+    /* Column 0 is strobed now, before the timer starts. Thereafter each
+     * update event releases column i and strobes column i+1. */
+    memset(dma_scan.idr, 0xff, sizeof(dma_scan.idr));
+    column_strobe(0);
+
+    rcc->apb1enr |= RCC_APB1ENR_TIM3EN;
+    peripheral_clock_delay();
+
+    /* All columns are allotted the longest calibrated settle time. */
+    for (i = 0; i < NR_COLS; i++)
+        settle_us = max_t(unsigned int, settle_us,
+                          (scan.settle[i] + TIME_MHZ - 1) / TIME_MHZ);
+
+    /* 1MHz timebase. Rows are sampled on the final tick of each period. */
+    scan_tim->psc = SYSCLK_MHZ-1;
+    scan_tim->arr = settle_us;
+    scan_tim->ccr1 = settle_us;
+    scan_tim->ccmr1 = TIM_CCMR1_CC1S(TIM_CCS_OUTPUT)
+        | TIM_CCMR1_OC1M(TIM_OCM_FROZEN);
+    scan_tim->ccer = 0;
+    scan_tim->egr = TIM_EGR_UG; /* update CNT, PSC, ARR */
+    scan_tim->sr = 0;
+
+    dma_col.cr = 0;
+    dma_col.par = (uint32_t)(unsigned long)&gpio_col->bsrr;
+    dma_col.mar = (uint32_t)(unsigned long)col_dma_bsrr;
+    dma_col.ndtr = ARRAY_SIZE(col_dma_bsrr);
+    dma_col.cr = (DMA_CR_PL_HIGH |
+                  DMA_CR_MSIZE_32BIT |
+                  DMA_CR_PSIZE_32BIT |
+                  DMA_CR_MINC |
+                  DMA_CR_CIRC |
+                  DMA_CR_DIR_M2P |
+                  DMA_CR_EN);
+
+    dma_row.cr = 0;
+    dma_row.par = (uint32_t)(unsigned long)&gpio_row->idr;
+    dma_row.mar = (uint32_t)(unsigned long)dma_scan.idr;
+    dma_row.ndtr = ARRAY_SIZE(dma_scan.idr);
+    dma_row.cr = (DMA_CR_PL_HIGH |
+                  DMA_CR_MSIZE_16BIT |
+                  DMA_CR_PSIZE_32BIT |
+                  DMA_CR_MINC |
+                  DMA_CR_CIRC |
+                  DMA_CR_DIR_P2M |
+                  DMA_CR_HTIE |
+                  DMA_CR_TCIE |
+                  DMA_CR_EN);
+    dma1->ifcr = DMA_IFCR_CGIF(DMA_ROW_CH);
+
+    scan_tim->dier = TIM_DIER_UDE | TIM_DIER_CC1DE;
+    scan_tim->cr1 = TIM_CR1_URS | TIM_CR1_CEN;
+}
+
+static void dma_scan_stop(void)
+{
+    scan_tim->cr1 = 0;
+    scan_tim->dier = 0;
+    dma_col.cr = 0;
+    dma_row.cr = 0;
+    dma1->ifcr = DMA_IFCR_CGIF(DMA_ROW_CH);
+}
+
+static bool_t dma_scan_get_snapshot(struct matrix_snapshot *snap)
+{
+    uint32_t isr = dma1->isr & (DMA_ISR_HTIF(DMA_ROW_CH)
+                                | DMA_ISR_TCIF(DMA_ROW_CH));
+    const uint16_t *p;
+    unsigned int i, half;
+
+    /* Nothing to do unless a half of the capture ring has been filled. The
+     * IRQ which signalled it can now be taken again. */
+    dma1->ifcr = isr;
+    IRQx_enable(DMA_ROW_IRQ);
+    if (!isr)
+        return FALSE;
+
+    /* Copy out the half that the DMA engine is not currently filling. Retry
+     * if the DMA engine moved on to that half while we were copying. */
+    do {
+        half = (dma_row.ndtr > NR_COLS) ? 1 : 0;
+        p = &dma_scan.idr[half * NR_COLS];
+        for (i = 0; i < NR_COLS; i++)
+            snap->rows[i] = ~p[i] & ROW_MASK;
+    } while (half != ((dma_row.ndtr > NR_COLS) ? 1 : 0));
+
+    snap->special = special_keys_read();
+    snap->time = time_now();
+
+    return TRUE;
 }
 
-static void report_init(struct usb_report *report)
+/* A half of the capture ring has been filled. The IRQ is masked until
+ * keyboard_process() has collected the snapshot. */
+static void IRQ_dma_scan(void)
 {
-    memset(report, 0, sizeof(*report));
+    IRQx_disable(DMA_ROW_IRQ);
+    work_post(WORK_KEYBOARD);
+}
+
+/* Retrieve the most recent complete scan, if it has not been seen before. */
+static bool_t scan_get_snapshot(struct matrix_snapshot *snap)
+{
+    uint32_t oldpri, seq;
+
+    if (SCAN_DMA)
+        return dma_scan_get_snapshot(snap);
+
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    seq = scan.seq;
+    *snap = scan.done;
+    IRQ_restore(oldpri);
+
+    if (seq == last_seq)
+        return FALSE;
+
+    last_seq = seq;
+    return TRUE;
+}
+
+static bool_t is_modifier(uint8_t code)
+{
+    return (code >= 0xe0) && (code <= 0xe7);
 }
 
 static void report_add(struct usb_report *report, uint8_t code)
 {
-    if ((code >= 0xe0) && (code <= 0xe7)) {
+    if (is_modifier(code)) {
 
-        report->buf[0] |= 1u << (code & 7);
+        report->boot[0] |= 1u << (code & 7);
 
-    } else if (report->nr_codes == 6) {
+    } else if (report->nr_codes++ >= 6) {
 
         /* Overflow: Phantom state */
-        memset(&report->buf[2], 0x01, 6);
+        memset(&report->boot[2], 0x01, 6);
 
     } else {
 
-        report->buf[2 + report->nr_codes++] = code;
+        report->boot[1 + report->nr_codes] = code;
 
     }
 }
 
-static void keyboard_scan(struct usb_report *report)
+/* Build the Boot Protocol report from the NKRO bitmap. */
+static void report_build(struct usb_report *report)
 {
-    int i, j;
+    uint32_t x;
+    unsigned int i;
+
+    memset(report->boot, 0, sizeof(report->boot));
+    report->nr_codes = 0;
+
+    for (i = 0; i < NKRO_BYTES; i++) {
+        for (x = report->nkro[i]; x != 0; x &= x - 1)
+            report_add(report, i*8 + __builtin_ctz(x));
+    }
+}
+
+static void report_remove(struct usb_report *report, uint8_t code)
+{
+    uint8_t *p = &report->boot[2];
+    unsigned int i;
+
+    if (is_modifier(code)) {
+
+        report->boot[0] &= ~(1u << (code & 7));
+
+    } else if (report->nr_codes-- > 6) {
+
+        /* Leaving overflow: The report must be rebuilt from scratch. */
+        if (report->nr_codes == 6)
+            report_build(report);
+
+    } else {
+
+        for (i = 0; (i < 6) && (p[i] != code); i++)
+            continue;
+        if (i == 6) {
+            /* Not found: Resynchronise with the bitmap. */
+            report_build(report);
+            return;
+        }
+        memmove(&p[i], &p[i+1], 5 - i);
+        p[5] = 0;
+
+    }
+}
+
+/* Press or release a USB usage. Usages are reference-free: when several
+ * keys share a usage, the first release releases it. */
+static void report_usage(struct usb_report *report, uint8_t code,
+                         bool_t pressed)
+{
+    uint8_t *b = &report->nkro[code/8], bit = 1u << (code & 7);
+
+    if (!!(*b & bit) == pressed)
+        return;
+
+    /* Update the bitmap first: report_remove() may rebuild from it. */
+    if (pressed) {
+        *b |= bit;
+        report_add(report, code);
+    } else {
+        *b &= ~bit;
+        report_remove(report, code);
+    }
+    report->dirty = TRUE;
+}
+
+static void macro_timer_fn(void *unused)
+{
+    macro.delay = FALSE;
+    work_post(WORK_KEYBOARD);
+}
 
-    report_init(report);
-
-    for (i = 0; i < ARRAY_SIZE(a1200_matrix); i++) {
-        const struct a1200_column *col = &a1200_matrix[i];
-        uint32_t idr;
-        gpio_write_pin(gpio_from_id(col->gpio), col->pin, LOW);
-        delay_us(20);
-        idr = gpio_row->idr;
-        for (j = 0; j < 6; j++) {
-            if (!(idr & 1))
-                report_add(report, a1200_usb_map[col->code[j]]);
-            idr >>= 1;
+static void macro_start(uint8_t idx)
+{
+    if (macro.playing)
+        return;
+
+    memset(&macro.report, 0, sizeof(macro.report));
+    macro.idx = idx;
+    macro.step = 0;
+    macro.tap = FALSE;
+    macro.playing = TRUE;
+}
+
+static void macro_stop(void)
+{
+    timer_cancel(&macro.timer);
+    macro.delay = FALSE;
+    macro.playing = FALSE;
+}
+
+/* Play macro steps until a report is ready to send, a delay is started, or
+ * the macro ends. Returns TRUE while playback owns the interrupt endpoint. */
+static bool_t macro_process(void)
+{
+    const struct samisara_macro_step *s;
+
+    while (macro.playing && !macro.delay && !macro.report.dirty) {
+
+        if (macro.tap) {
+            s = &config.macro[macro.idx][macro.step-1];
+            report_usage(&macro.report, s->arg, FALSE);
+            macro.tap = FALSE;
+            continue;
         }
-        gpio_write_pin(gpio_from_id(col->gpio), col->pin, HIGH);
+
+        s = (macro.step < SAMISARA_MACRO_STEPS)
+            ? &config.macro[macro.idx][macro.step++] : NULL;
+
+        switch (s ? s->op : SAMISARA_MACRO_END) {
+        case SAMISARA_MACRO_PRESS:
+            report_usage(&macro.report, s->arg, TRUE);
+            break;
+        case SAMISARA_MACRO_RELEASE:
+            report_usage(&macro.report, s->arg, FALSE);
+            break;
+        case SAMISARA_MACRO_TAP:
+            report_usage(&macro.report, s->arg, TRUE);
+            macro.tap = TRUE;
+            break;
+        case SAMISARA_MACRO_DELAY:
+            macro.delay = TRUE;
+            timer_set(&macro.timer, time_now() + time_ms(s->arg));
+            break;
+        default:
+            /* The keyboard report supersedes the macro's. */
+            macro.playing = FALSE;
+            report.dirty = TRUE;
+            break;
+        }
+
     }
 
-    for (i = 0; i < ARRAY_SIZE(special_key); i++) {
-        const struct special_key *sk = &special_key[i];
-        bool_t pressed = !gpio_read_pin(gpio_from_id(sk->gpio), sk->pin);
+    return macro.playing || macro.report.dirty;
+}
+
+static uint8_t keymap_lookup(uint8_t key)
+{
+    uint8_t code;
+
+    if (key >= SAMISARA_KEYMAP_KEYS)
+        return 0;
+
+    code = config.keymap[0][key];
+    if (keymap.nr_fn && config.keymap[1][key])
+        code = config.keymap[1][key];
+    return code;
+}
+
+/* Apply a key press or release to the USB reports. */
+static void report_key(uint8_t key, bool_t pressed)
+{
+    uint8_t code;
+
+    if (pressed)
+        keymap.code[key] = keymap_lookup(key);
+    code = keymap.code[key];
+
+    if (code == SAMISARA_KEYMAP_FN) {
+        keymap.nr_fn += pressed ? 1 : -1;
+    } else if (code >= SAMISARA_KEYMAP_MACRO(0)) {
         if (pressed)
-            report_add(report, a1200_usb_map[sk->code]);
+            macro_start(code - SAMISARA_KEYMAP_MACRO(0));
+    } else if (code != 0) {
+        report_usage(&report, code, pressed);
+    }
+}
+
+static bool_t event_push(uint8_t key, bool_t pressed, time_t time)
+{
+    struct key_event *ev;
+    uint16_t prod = events.prod, depth = prod - events.cons;
+
+    if (depth == NR_EVENTS)
+        return FALSE;
+
+    ev = &events.ring[prod & (NR_EVENTS-1)];
+    ev->time = time;
+    ev->key = key;
+    ev->pressed = pressed;
+    barrier(); /* populate slot /then/ publish it */
+    events.prod = prod + 1;
+
+    events.nr_events++;
+    if (++depth > events.max_depth)
+        events.max_depth = depth;
+    return TRUE;
+}
+
+/* Queue an event for each key whose state differs from that already
+ * queued. Each event is timestamped from @edge[]. */
+static void keys_update(const uint32_t *keys, const time_t *edge, time_t now)
+{
+    uint32_t x;
+    unsigned int w, b;
+
+    for (w = 0; w < KEY_WORDS; w++) {
+        for (x = keys[w] ^ events.queued[w]; x != 0; x &= x - 1) {
+            b = __builtin_ctz(x);
+            if (!event_push(w*32 + b, (keys[w] >> b) & 1, edge[w*32 + b])) {
+                if (!events.backlog) {
+                    events.nr_overflows++;
+                    telemetry_log(SAMISARA_TELEMETRY_ERROR,
+                                  SAMISARA_ERROR_OVERFLOW, 0, now);
+                }
+                events.backlog = TRUE;
+                return;
+            }
+            events.queued[w] ^= 1u << b;
+            telemetry_log(SAMISARA_TELEMETRY_KEY, w*32 + b,
+                          (keys[w] >> b) & 1, edge[w*32 + b]);
+        }
+    }
+
+    events.backlog = FALSE;
+}
+
+/* Trace a key event, entering the batch being built for the next report. */
+static void trace_event(time_t scan)
+{
+    /* A batch held back throughout a long macro may fill the ring. */
+    if ((uint16_t)(trace.prod - trace.batch) == NR_TRACE)
+        return;
+    trace.ring[trace.prod++ & (NR_TRACE-1)].scan = scan;
+}
+
+/* The batch's report has been queued for the host. */
+static void trace_queued(void)
+{
+    time_t now = time_now();
+    uint16_t i;
+
+    for (i = trace.batch; i != trace.prod; i++)
+        trace.ring[i & (NR_TRACE-1)].queued = now;
+    trace.in_flight = (trace.batch != trace.prod);
+}
+
+/* The batch's report was collected by the host at time @done. */
+static void trace_done(time_t done)
+{
+    uint16_t i;
+
+    for (i = trace.batch; i != trace.prod; i++)
+        trace.ring[i & (NR_TRACE-1)].done = done;
+    trace.nr_events += (uint16_t)(trace.prod - trace.batch);
+    trace.batch = trace.prod;
+    trace.in_flight = FALSE;
+}
+
+/* Apply the next batch of queued events to the USB report. A batch ends
+ * before the first event on a key already changed by the batch, so that
+ * every transition of that key is seen by the host. */
+static void report_update(void)
+{
+    uint32_t batch[KEY_WORDS], bit;
+    struct key_event *ev;
+    uint16_t cons = events.cons;
+    unsigned int w;
+
+    memset(batch, 0, sizeof(batch));
+
+    while (cons != events.prod) {
+        barrier(); /* read prod /then/ the slot it publishes */
+        ev = &events.ring[cons & (NR_EVENTS-1)];
+        w = ev->key / 32;
+        bit = 1u << (ev->key & 31);
+        if (batch[w] & bit)
+            break;
+        batch[w] |= bit;
+        trace_event(ev->time);
+        report_key(ev->key, ev->pressed);
+        cons++;
+    }
+
+    barrier(); /* consume slots /then/ release them */
+    events.cons = cons;
+}
+
+void keyboard_get_events(struct samisara_subreport_events *s)
+{
+    s->nr_slots = NR_EVENTS;
+    s->depth = (uint16_t)(events.prod - events.cons);
+    s->max_depth = events.max_depth;
+    s->nr_events = events.nr_events;
+    s->nr_overflows = events.nr_overflows;
+}
+
+void keyboard_get_latency(struct samisara_subreport_latency *l)
+{
+    uint32_t lat[NR_TRACE], x;
+    const struct trace_entry *e;
+    unsigned int n, s, i, j;
+
+    n = min_t(unsigned int, trace.nr_events,
+              NR_TRACE - (uint16_t)(trace.prod - trace.batch));
+    l->nr_events = trace.nr_events;
+    l->nr_samples = n;
+
+    for (s = 0; s < ARRAY_SIZE(l->stage); s++) {
+        for (i = 0; i < n; i++) {
+            e = &trace.ring[(trace.batch - n + i) & (NR_TRACE-1)];
+            x = (s == 0) ? e->queued - e->scan
+                : (s == 1) ? e->done - e->queued
+                : e->done - e->scan;
+            /* Insertion sort: n is small. */
+            for (j = i; (j > 0) && (lat[j-1] > x); j--)
+                lat[j] = lat[j-1];
+            lat[j] = x;
+        }
+        l->stage[s].p50_us = n ? lat[(n-1)/2] / TIME_MHZ : 0;
+        l->stage[s].p99_us = n ? lat[((n-1)*99)/100] / TIME_MHZ : 0;
+        l->stage[s].max_us = n ? lat[n-1] / TIME_MHZ : 0;
+    }
+}
+
+void keyboard_reset_latency(void)
+{
+    trace.nr_events = 0;
+}
+
+void keyboard_default_keymap(struct config *c)
+{
+    BUILD_BUG_ON(SAMISARA_KEYMAP_KEYS > NR_KEYS);
+    memcpy(c->keymap[0], key_usb, SAMISARA_KEYMAP_KEYS);
+    memset(c->keymap[1], 0, SAMISARA_KEYMAP_KEYS);
+}
+
+bool_t keyboard_set_keymap(const struct samisara_cmd_keymap *cmd)
+{
+    unsigned int i;
+
+    if ((cmd->layer >= SAMISARA_KEYMAP_LAYERS)
+        || (cmd->nr > ARRAY_SIZE(cmd->usage))
+        || (cmd->first + cmd->nr > SAMISARA_KEYMAP_KEYS))
+        return FALSE;
+
+    /* Usages beyond the NKRO bitmap are invalid. */
+    for (i = 0; i < cmd->nr; i++) {
+        uint8_t u = cmd->usage[i];
+        if ((u > 0xe7) && (u != SAMISARA_KEYMAP_FN)
+            && ((u < SAMISARA_KEYMAP_MACRO(0))
+                || (u >= SAMISARA_KEYMAP_MACRO(SAMISARA_NR_MACROS))))
+            return FALSE;
+    }
+
+    memcpy(&config.keymap[cmd->layer][cmd->first], cmd->usage, cmd->nr);
+    return TRUE;
+}
+
+bool_t keyboard_set_macro(const struct samisara_cmd_macro *cmd)
+{
+    const struct samisara_macro_step *s;
+    unsigned int i;
+
+    if ((cmd->macro >= SAMISARA_NR_MACROS)
+        || (cmd->nr > ARRAY_SIZE(cmd->step))
+        || (cmd->first + cmd->nr > SAMISARA_MACRO_STEPS))
+        return FALSE;
+
+    for (i = 0; i < cmd->nr; i++) {
+        s = &cmd->step[i];
+        switch (s->op) {
+        case SAMISARA_MACRO_PRESS:
+        case SAMISARA_MACRO_RELEASE:
+        case SAMISARA_MACRO_TAP:
+            if ((s->arg == 0) || (s->arg > 0xe7))
+                return FALSE;
+            break;
+        case SAMISARA_MACRO_END:
+        case SAMISARA_MACRO_DELAY:
+            break;
+        default:
+            return FALSE;
+        }
+    }
+
+    /* The macro may be playing: It is simply played as amended. */
+    memcpy(&config.macro[cmd->macro][cmd->first], cmd->step,
+           cmd->nr * sizeof(*s));
+    return TRUE;
+}
+
+/* Remove possible ghost keys from @snap. */
+static void ghost_filter(struct matrix_snapshot *snap)
+{
+    uint8_t amb[NR_COLS], ri, common, held;
+    bool_t found = FALSE;
+    int i, j;
+
+    memset(amb, 0, sizeof(amb));
+
+    for (i = 0; i < NR_COLS-1; i++) {
+        /* A column with fewer than two rows pressed cannot take part. */
+        ri = snap->rows[i];
+        if (!(ri & (ri - 1)))
+            continue;
+        for (j = i+1; j < NR_COLS; j++) {
+            common = ri & snap->rows[j];
+            if (common & (common - 1)) {
+                amb[i] |= common;
+                amb[j] |= common;
+                found = TRUE;
+            }
+        }
+    }
+
+    if (found && !ghost.active) {
+        ghost.nr_detected++;
+        telemetry_log(SAMISARA_TELEMETRY_ERROR, SAMISARA_ERROR_GHOST,
+                      0, snap->time);
+    }
+    ghost.active = found;
+
+    for (i = 0; i < NR_COLS; i++) {
+        held = snap->rows[i] & amb[i] & ~ghost.rows[i];
+        for (ri = held & ~ghost.held[i]; ri != 0; ri &= ri - 1)
+            ghost.nr_held++;
+        ghost.held[i] = held;
+        snap->rows[i] &= ~held;
+        ghost.rows[i] = snap->rows[i];
+    }
+}
+
+void keyboard_get_ghost(struct samisara_subreport_ghost *g)
+{
+    g->nr_detected = ghost.nr_detected;
+    g->nr_held = ghost.nr_held;
+}
+
+static void key_set(uint32_t *keys, uint8_t key)
+{
+    if (key != KEY_NONE)
+        keys[key/32] |= 1u << (key & 31);
+}
+
+/* Convert a matrix snapshot to a bitmap of pressed keys. */
+static void keyboard_scan(uint32_t *keys, const struct matrix_snapshot *snap)
+{
+    uint32_t special;
+    uint8_t rows;
+    int i;
+
+    memset(keys, 0, KEY_WORDS * sizeof(*keys));
+
+    for (i = 0; i < NR_COLS; i++) {
+        const uint8_t *key = matrix_key[i];
+        for (rows = snap->rows[i]; rows != 0; rows &= rows - 1)
+            key_set(keys, key[__builtin_ctz(rows)]);
+    }
+
+    for (special = snap->special; special != 0; special &= special - 1)
+        key_set(keys, special_key[__builtin_ctz(special)]);
+}
+
+/* Apply a raw key sample, taken at time @now, to the debounced key state.
+ * Returns TRUE if the debounced state has changed. */
+static bool_t debounce_update(const uint32_t *raw, time_t now)
+{
+    struct debounce *db = &debounce;
+    unsigned int w, mode = db->conf.mode;
+    int32_t period = time_ms((mode == SAMISARA_DEBOUNCE_EAGER)
+                             ? db->conf.eager_ms : db->conf.deferred_ms);
+    uint32_t x, edges;
+    bool_t changed = FALSE;
+
+    for (w = 0; w < KEY_WORDS; w++) {
+
+        time_t *t = &db->t[w*32];
+
+        /* Note the start of each new transition away from the debounced
+         * state. In Deferred mode, bounces within the debounce period
+         * belong to the transition already started. */
+        x = (raw[w] ^ db->state[w]) & ~(db->raw[w] ^ db->state[w]);
+        if (mode == SAMISARA_DEBOUNCE_DEFERRED)
+            x &= ~db->timing[w];
+        for (; x != 0; x &= x - 1)
+            db->edge[w*32 + __builtin_ctz(x)] = now;
+
+        /* Deferred: Every raw edge restarts the key's debounce period. */
+        if (mode == SAMISARA_DEBOUNCE_DEFERRED) {
+            edges = raw[w] ^ db->raw[w];
+            for (x = edges; x != 0; x &= x - 1)
+                t[__builtin_ctz(x)] = now;
+            db->timing[w] |= edges;
+        }
+        db->raw[w] = raw[w];
+
+        /* Retire elapsed debounce periods. */
+        for (x = db->timing[w]; x != 0; x &= x - 1) {
+            unsigned int b = __builtin_ctz(x);
+            if (time_diff(t[b], now) >= period)
+                db->timing[w] &= ~(1u << b);
+        }
+
+        /* Report edges on all keys outside a debounce period. */
+        edges = (raw[w] ^ db->state[w]) & ~db->timing[w];
+        if (edges == 0)
+            continue;
+        db->state[w] ^= edges;
+        changed = TRUE;
+
+        /* Eager: Lock out further edges for the debounce period. */
+        if (mode == SAMISARA_DEBOUNCE_EAGER) {
+            for (x = edges; x != 0; x &= x - 1)
+                t[__builtin_ctz(x)] = now;
+            db->timing[w] |= edges;
+        }
+    }
+
+    return changed;
+}
+
+static bool_t keys_empty(const uint32_t *keys)
+{
+    unsigned int w;
+    for (w = 0; w < KEY_WORDS; w++)
+        if (keys[w])
+            return FALSE;
+    return TRUE;
+}
+
+/* Enter idle mode once all keys have been released, and stable, for the
+ * idle timeout period. */
+static void idle_check(const uint32_t *keys, time_t now)
+{
+    if (!keys_empty(keys) || !keys_empty(debounce.state)
+        || !keys_empty(debounce.timing)) {
+        idle.last_active = now;
+    } else if (idle.suspended
+               || (idle.timeout_ms
+                   && (time_diff(idle.last_active, now)
+                       >= (int32_t)time_ms(idle.timeout_ms)))) {
+        idle_enter();
     }
 }
 
+bool_t keyboard_set_debounce(const struct samisara_cmd_debounce *conf)
+{
+    if (conf->mode > SAMISARA_DEBOUNCE_DEFERRED)
+        return FALSE;
+
+    debounce.conf = *conf;
+    memset(debounce.timing, 0, sizeof(debounce.timing));
+    return TRUE;
+}
+
+void keyboard_get_debounce(struct samisara_cmd_debounce *conf)
+{
+    *conf = debounce.conf;
+}
+
+static void repeat_timer_fn(void *unused)
+{
+    repeat.due = TRUE;
+    work_post(WORK_KEYBOARD);
+}
+
+/* Start a new idle period. */
+static void repeat_arm(void)
+{
+    repeat.due = FALSE;
+    if (repeat.idle_rate == 0)
+        timer_cancel(&repeat.timer);
+    else
+        timer_set(&repeat.timer, time_now() + time_ms(4 * repeat.idle_rate));
+}
+
+static void report_send(struct usb_report *r, uint8_t protocol)
+{
+    if (protocol == KBD_PROTOCOL_BOOT)
+        usb_write(ep_tx, r->boot, sizeof(r->boot));
+    else
+        usb_write(ep_tx, r->nkro, sizeof(r->nkro));
+    r->dirty = FALSE;
+}
+
 void keyboard_process(void)
 {
-    struct usb_report report;
+    struct matrix_snapshot snap;
+    uint32_t keys[KEY_WORDS];
+    uint8_t protocol, idle_rate;
 
     if (!initialised)
         return;
 
     gpio_write_pin(gpiob, 2, (kbd_led() & 2) ? HIGH : LOW);
 
-    keyboard_scan(&report);
+    if (scan_get_snapshot(&snap)) {
+        uint32_t t = stats_start();
+        ghost_filter(&snap);
+        keyboard_scan(keys, &snap);
+        if (debounce_update(keys, snap.time) || events.backlog) {
+            if (idle.suspended)
+                usb_remote_wakeup();
+            keys_update(debounce.state, debounce.edge, snap.time);
+        }
+        idle_check(keys, snap.time);
+        stats_end(STATS_SNAPSHOT, t);
+    }
+
+    if (idle.suspended && (idle.slow != idle.active)) {
+        idle.slow = idle.active;
+        clock_slow(idle.slow);
+    }
+
+    protocol = kbd_protocol();
+    if (protocol != report.protocol) {
+        report.protocol = protocol;
+        report.dirty = TRUE;
+    }
+
+    idle_rate = kbd_idle_rate();
+    if (idle_rate != repeat.idle_rate) {
+        repeat.idle_rate = idle_rate;
+        repeat_arm();
+    }
+
+    /* One report per poll: apply the next batch of events only when the
+     * previous report has been collected by the host. */
+    if (!ep_tx_ready(ep_tx))
+        return;
+
+    if (trace.in_flight)
+        trace_done(ep_tx_time(ep_tx));
 
-    if (initialised && ep_tx_ready(EP_TX)
-        && memcmp(report.buf, last_report.buf, 8)) {
-            usb_write(EP_TX, report.buf, 8);
-            last_report = report;
+    report_update();
+
+    if (macro_process()) {
+        if (macro.report.dirty)
+            report_send(&macro.report, protocol);
+    } else if (report.dirty || repeat.due) {
+        report_send(&report, protocol);
+        trace_queued();
+        repeat_arm();
+    } else {
+        /* These events changed nothing: there is nothing to trace. */
+        trace.prod = trace.batch;
     }
 }
 
 static void usb_hid_reset(void)
 {
+    telemetry_stop();
     initialised = FALSE;
     gpio_write_pin(gpiob, 2, LOW);
 }
 
 static void usb_hid_configure(void)
 {
-    memset(&last_report, 0xff, sizeof(last_report));
+    macro_stop();
+    trace.prod = trace.batch;
+    trace.in_flight = FALSE;
+    repeat.idle_rate = 0;
+    repeat_arm();
+    report.dirty = TRUE;
+    idle.last_active = time_now();
     initialised = TRUE;
     count = 0;
 }
 
+static void usb_hid_suspend(void)
+{
+    idle.suspended = TRUE;
+}
+
+static void usb_hid_resume(void)
+{
+    if (idle.slow)
+        clock_slow(FALSE);
+    idle.slow = idle.suspended = FALSE;
+    idle.last_active = time_now();
+}
+
 const struct usb_class_ops usb_class_ops = {
     .reset = usb_hid_reset,
-    .configure = usb_hid_configure
+    .configure = usb_hid_configure,
+    .suspend = usb_hid_suspend,
+    .resume = usb_hid_resume
 };
 
 
@@ -40,6 +40,17 @@ void reset_to_bootloader(void)
     system_reset();
 }
 
+/* Bitmap of WORK_* posted by interrupt handlers. */
+static volatile uint32_t work_pending;
+
+void work_post(unsigned int work)
+{
+    uint32_t flags;
+    IRQ_global_save(flags);
+    work_pending |= 1u << work;
+    IRQ_global_restore(flags);
+}
+
 int main(void)
 {
     if (check_bootloader_requested()) {
@@ -58,6 +69,7 @@ int main(void)
 
     canary_init();
     stm32_init();
+    stats_init();
     time_init();
     console_init();
     console_crash_on_input();
@@ -68,13 +80,54 @@ int main(void)
     printk("** Keir Fraser <keir.xen@gmail.com>\n");
     printk("** https://github.com/keirf/samisara\n\n");
 
+    config_init();
     keyboard_init();
+    telemetry_init();
     usb_init();
 
     for (;;) {
+        uint32_t loop_start, work, t;
+
+        /* Sleep until work is posted. WFI wakes on a pending IRQ even with
+         * IRQs masked, so work posted after the check is not missed. Other
+         * IRQs (eg. timers) may wake us with no work to do. */
+        IRQ_global_disable();
+        while (!work_pending) {
+            time_t t0 = time_now();
+            cpu_wfi();
+            stats_add(STATS_SLEEP, sysclk_time(time_since(t0)));
+            IRQ_global_enable();
+            cpu_sync(); /* take the IRQ that woke us */
+            IRQ_global_disable();
+        }
+        work = work_pending;
+        work_pending = 0;
+        IRQ_global_enable();
+
+        loop_start = stats_start();
         canary_check();
-        usb_process();
-        keyboard_process();
+        /* Erasing and programming flash stalls us for tens of milliseconds,
+         * so is never done within a USB request. It is done before any
+         * further request is handled. */
+        if (work & (1u<<WORK_CONFIG))
+            config_save();
+        if (work & (1u<<WORK_USB)) {
+            t = stats_start();
+            usb_process();
+            stats_end(STATS_USB, t);
+        }
+        /* USB events (a report collected, LED and protocol changes) also
+         * feed the keyboard. */
+        if (work & ((1u<<WORK_USB) | (1u<<WORK_KEYBOARD))) {
+            t = stats_start();
+            keyboard_process();
+            stats_end(STATS_KEYBOARD, t);
+        }
+        /* Records are logged, and counters fall due, as telemetry work. USB
+         * work may find the endpoint ready for further records. */
+        if (work & ((1u<<WORK_USB) | (1u<<WORK_TELEMETRY)))
+            telemetry_process();
+        stats_end(STATS_LOOP, loop_start);
     }
 
     return 0;
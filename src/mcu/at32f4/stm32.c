@@ -185,6 +185,24 @@ void stm32_init(void)
     cpu_sync();
 }
 
+void clock_slow(bool_t slow)
+{
+    uint32_t cfgr = rcc->cfgr & ~RCC_CFGR_HPRE_MASK;
+
+    /* SysTick normally runs at HCLK/8: Run it from the undivided HCLK
+     * while HCLK is itself divided by 8. The deadline timer runs from
+     * APB1, so is slowed, and must be told. */
+    if (slow) {
+        rcc->cfgr = cfgr | RCC_CFGR_HPRE_DIV8;
+        stk->ctrl |= STK_CTRL_CLKSOURCE;
+    } else {
+        rcc->cfgr = cfgr;
+        stk->ctrl &= ~STK_CTRL_CLKSOURCE;
+    }
+    cpu_sync();
+    timers_clock_div(slow ? 8 : 1);
+}
+
 void gpio_configure_pin(GPIO gpio, unsigned int pin, unsigned int mode)
 {
     gpio_write_pin(gpio, pin, mode >> 4);
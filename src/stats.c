@@ -0,0 +1,115 @@
+/*
+ * stats.c
+ * 
+ * Cycle-count statistics for hot-path code regions, measured by the DWT
+ * cycle counter. Each region records min/max/total and a log2 histogram.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+static struct stats {
+    uint32_t count, min, max;
+    uint64_t total;
+    uint32_t hist[STATS_NR_BUCKETS];
+} stats[NR_STATS];
+
+const static char stats_name[NR_STATS][8] = {
+    [STATS_LOOP]      = "loop",
+    [STATS_USB]       = "usb",
+    [STATS_KEYBOARD]  = "keyboard",
+    [STATS_SNAPSHOT]  = "snapshot",
+    [STATS_SCAN_STEP] = "scanstep",
+    [STATS_SLEEP]     = "sleep"
+};
+
+void stats_init(void)
+{
+    cdbg->demcr |= CDBG_DEMCR_TRCENA;
+    dwt->cyccnt = 0;
+    dwt->ctrl |= DWT_CTRL_CYCCNTENA;
+    stats_reset();
+}
+
+void stats_reset(void)
+{
+    unsigned int i;
+    uint32_t oldpri;
+
+    /* Regions may also be recorded in IRQ context. */
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    memset(stats, 0, sizeof(stats));
+    for (i = 0; i < NR_STATS; i++)
+        stats[i].min = ~0u;
+    IRQ_restore(oldpri);
+}
+
+void stats_add(unsigned int region, uint32_t cycles)
+{
+    struct stats *s = &stats[region];
+    int b;
+
+    b = 31 - __builtin_clz(cycles | 1) - STATS_BUCKET_SHIFT;
+    b = max(b, 0);
+    b = min(b, STATS_NR_BUCKETS-1);
+    s->hist[b]++;
+
+    s->count++;
+    s->total += cycles;
+    if (cycles < s->min)
+        s->min = cycles;
+    if (cycles > s->max)
+        s->max = cycles;
+}
+
+bool_t stats_get(unsigned int region, struct samisara_subreport_stats *r)
+{
+    struct stats *s;
+
+    if (region >= NR_STATS)
+        return FALSE;
+    s = &stats[region];
+
+    memset(r, 0, sizeof(*r));
+    r->region = region;
+    r->nr_regions = NR_STATS;
+    memcpy(r->name, stats_name[region], sizeof(r->name));
+    r->cpu_mhz = SYSCLK_MHZ;
+    r->nr_buckets = STATS_NR_BUCKETS;
+    r->bucket_shift = STATS_BUCKET_SHIFT;
+    r->count = s->count;
+    r->min = s->count ? s->min : 0;
+    r->max = s->max;
+    r->total = s->total;
+    return TRUE;
+}
+
+bool_t stats_get_hist(unsigned int region, unsigned int first,
+                      struct samisara_subreport_stats_hist *h)
+{
+    unsigned int nr;
+
+    if ((region >= NR_STATS) || (first >= STATS_NR_BUCKETS))
+        return FALSE;
+
+    nr = min_t(unsigned int, STATS_NR_BUCKETS - first,
+               ARRAY_SIZE(h->bucket));
+    memset(h, 0, sizeof(*h));
+    h->region = region;
+    h->first = first;
+    h->nr = nr;
+    memcpy(h->bucket, &stats[region].hist[first], nr * sizeof(uint32_t));
+    return TRUE;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,142 @@
+/*
+ * telemetry.c
+ * 
+ * Telemetry records pushed to the host as Input Reports on the vendor
+ * interface's interrupt IN endpoint.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Records are logged, and sent, only in thread context: no lock is needed.
+ * If the host is not collecting reports, the queue fills and further
+ * records are dropped (and counted) until there is space. */
+#define NR_RECORDS 64
+#define COUNTER_PERIOD_MS 1000
+static struct telemetry {
+    struct samisara_telemetry_rec ring[NR_RECORDS];
+    uint16_t prod, cons;   /* Free-running producer/consumer indexes */
+    uint32_t dropped;      /* Since the previous report */
+    uint8_t seq;
+    bool_t active;         /* Vendor interface configured */
+    volatile bool_t counters_due;
+    struct timer timer;
+} telemetry;
+
+static void counter_timer_fn(void *unused)
+{
+    telemetry.counters_due = TRUE;
+    timer_set(&telemetry.timer, time_add(telemetry.timer.deadline,
+                                         time_ms(COUNTER_PERIOD_MS)));
+    work_post(WORK_TELEMETRY);
+}
+
+void telemetry_init(void)
+{
+    timer_init(&telemetry.timer, counter_timer_fn, NULL);
+}
+
+void telemetry_start(void)
+{
+    telemetry.prod = telemetry.cons = 0;
+    telemetry.dropped = 0;
+    telemetry.seq = 0;
+    telemetry.counters_due = FALSE;
+    timer_set(&telemetry.timer, time_now() + time_ms(COUNTER_PERIOD_MS));
+    telemetry.active = TRUE;
+}
+
+void telemetry_stop(void)
+{
+    timer_cancel(&telemetry.timer);
+    telemetry.active = FALSE;
+}
+
+void telemetry_log(uint8_t type, uint8_t id, uint16_t val, time_t time)
+{
+    struct samisara_telemetry_rec *rec;
+
+    if (!telemetry.active)
+        return;
+
+    if ((uint16_t)(telemetry.prod - telemetry.cons) == NR_RECORDS) {
+        telemetry.dropped++;
+        return;
+    }
+
+    rec = &telemetry.ring[telemetry.prod & (NR_RECORDS-1)];
+    rec->time = time;
+    rec->type = type;
+    rec->id = id;
+    rec->val = val;
+    telemetry.prod++;
+    work_post(WORK_TELEMETRY);
+}
+
+static void log_counters(void)
+{
+    struct samisara_subreport_events events;
+    struct samisara_subreport_ghost ghost;
+    struct samisara_subreport_idle idle;
+    time_t now = time_now();
+
+    keyboard_get_events(&events);
+    keyboard_get_ghost(&ghost);
+    keyboard_get_idle(&idle);
+
+#define log(id, val) \
+    telemetry_log(SAMISARA_TELEMETRY_COUNTER, SAMISARA_COUNTER_##id, val, now)
+    log(EVENTS, events.nr_events);
+    log(OVERFLOWS, events.nr_overflows);
+    log(GHOSTS, ghost.nr_detected);
+    log(GHOST_HELD, ghost.nr_held);
+    log(WAKEUPS, idle.nr_wakeups);
+#undef log
+}
+
+void telemetry_process(void)
+{
+    uint8_t buf[SAMISARA_TELEMETRY_REPORT_SZ+1];
+    struct samisara_telemetry *t = (struct samisara_telemetry *)&buf[1];
+    unsigned int i, nr;
+
+    BUILD_BUG_ON(sizeof(*t) > SAMISARA_TELEMETRY_REPORT_SZ);
+
+    if (!telemetry.active)
+        return;
+
+    /* Counters are not sent while the host cannot collect them. */
+    if (telemetry.counters_due) {
+        telemetry.counters_due = FALSE;
+        if (!usb_is_suspended())
+            log_counters();
+    }
+
+    nr = (uint16_t)(telemetry.prod - telemetry.cons);
+    if ((nr == 0) || !ep_tx_ready(ep_telemetry))
+        return;
+
+    memset(buf, 0, sizeof(buf));
+    buf[0] = SAMISARA_TELEMETRY_REPORT_ID;
+    t->seq = telemetry.seq++;
+    t->nr = nr = min_t(unsigned int, nr, ARRAY_SIZE(t->rec));
+    t->dropped = min_t(uint32_t, telemetry.dropped, 255);
+    t->time_mhz = TIME_MHZ;
+    for (i = 0; i < nr; i++)
+        t->rec[i] = telemetry.ring[telemetry.cons++ & (NR_RECORDS-1)];
+    telemetry.dropped = 0;
+
+    usb_write(ep_telemetry, buf, sizeof(buf));
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -34,17 +34,20 @@ void IRQ_50(void) __attribute__((alias("IRQ_timer")));
 
 static struct timer *head;
 
+/* Division of the timer's clock from its nominal rate (see clock_slow()). */
+static unsigned int clock_div = 1;
+
 static void reprogram_timer(int32_t delta)
 {
     tim->cr1 = TIM_CR1;
     if ((tim_bits == 32) || (delta < 0x10000)) {
         /* Fine-grained deadline (sub-microsecond accurate) */
-        tim->psc = SYSCLK_MHZ/TIME_MHZ-1;
+        tim->psc = SYSCLK_MHZ/TIME_MHZ/clock_div-1;
         tim->arr = (delta <= SLACK_TICKS) ? 1 : delta-SLACK_TICKS;
     } else {
         /* Coarse-grained deadline, fires in time to set a shorter,
          * fine-grained deadline. */
-        tim->psc = sysclk_us(100)-1;
+        tim->psc = sysclk_us(100)/clock_div-1;
         tim->arr = min_t(uint32_t, 0xffffu,
                          delta/time_us(100)-10); /* 1ms early */
     }
@@ -114,6 +117,17 @@ void timer_cancel(struct timer *timer)
     IRQ_restore(oldpri);
 }
 
+void timers_clock_div(unsigned int div)
+{
+    uint32_t oldpri;
+
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    clock_div = div;
+    if (head != NULL)
+        reprogram_timer(time_diff(time_now(), head->deadline));
+    IRQ_restore(oldpri);
+}
+
 void timers_init(void)
 {
 #if MCU == AT32F4
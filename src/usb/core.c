@@ -27,18 +27,54 @@ const static struct usb_device_descriptor device_descriptor aligned(2) = {
     .bNumConfigurations = 1
 };
 
-static char serial_string[32];
-const static char * const string_descriptors[] = {
-    "\x09\x04", /* LANGID: US English */
-    "Keir Fraser",
-    "Samisara",
-    serial_string
+USB_STRING_DESCRIPTOR(langid_string, "\x0409"); /* US English */
+USB_STRING_DESCRIPTOR(manufacturer_string, "Keir Fraser");
+USB_STRING_DESCRIPTOR(product_string, "Samisara");
+
+/* "SS" followed by the 96-bit unique ID in hex. Filled in by usb_init(). */
+static struct packed {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t wString[2+24];
+} serial_string aligned(2);
+
+const static void * const string_descriptors[] = {
+    &langid_string,
+    &manufacturer_string,
+    &product_string,
+    &serial_string
 };
 
+/* Built by usb_init(), as it depends on the persisted configuration. A
+ * change to that configuration takes effect on re-enumeration. Empty if
+ * the descriptor does not fit. */
+static uint8_t config_descriptor[128] aligned(4);
+static unsigned int config_descriptor_len;
+
+static unsigned int build_configuration_descriptor(uint8_t *dat,
+                                                   unsigned int max)
+{
+    unsigned int sz = hid_build_configuration_descriptor(dat, max);
+    if (sz != 0)
+        ((struct usb_configuration_descriptor *)dat)->wTotalLength = sz;
+    return sz;
+}
+
 void usb_init(void)
 {
-    snprintf(serial_string, sizeof(serial_string),
+    char serial[ARRAY_SIZE(serial_string.wString)+1];
+    unsigned int i;
+
+    snprintf(serial, sizeof(serial),
              "SS%08X%08X%08X", ser_id[0], ser_id[1], ser_id[2]);
+    serial_string.bLength = sizeof(serial_string);
+    serial_string.bDescriptorType = USB_DT_STRING;
+    for (i = 0; i < ARRAY_SIZE(serial_string.wString); i++)
+        serial_string.wString[i] = serial[i];
+
+    config_descriptor_len = build_configuration_descriptor(
+        config_descriptor, sizeof(config_descriptor));
+    ASSERT(config_descriptor_len != 0);
     hw_usb_init();
 }
 
@@ -47,80 +83,148 @@ void usb_deinit(void)
     hw_usb_deinit();
 }
 
-static unsigned int build_configuration_descriptor(uint8_t *dat)
+void ep0_send_static(const void *p, unsigned int len)
 {
-    unsigned int sz = hid_build_configuration_descriptor(dat);
-    ((struct usb_configuration_descriptor *)dat)->wTotalLength = sz;
-    return sz;
+    ep0.tx.p = p;
+    ep0.data_len = len;
 }
 
-static bool_t handle_control_request(void)
+static bool_t get_status(void)
 {
     struct usb_device_request *req = &ep0.req;
-    bool_t handled = TRUE;
+    bool_t halt;
+
+    ep0.data_len = 2;
+    memset(ep0.data, 0, ep0.data_len);
+
+    switch (USB_RECIP(req->bmRequestType)) {
+    case USB_RECIP_DEVICE:
+        if (hw_remote_wakeup_enabled())
+            ep0.data[0] |= 1u << USB_FEAT_DEVICE_REMOTE_WAKEUP;
+        break;
+    case USB_RECIP_ENDPOINT:
+        if (!hw_ep_get_halt(req->wIndex, &halt))
+            return FALSE;
+        if (halt)
+            ep0.data[0] |= 1u << USB_FEAT_ENDPOINT_HALT;
+        break;
+    }
 
-    if (ep0_data_out() && (req->wLength > sizeof(ep0.data))) {
+    return TRUE;
+}
 
-        WARN("Ctl OUT too long: %u>%u\n", req->wLength, sizeof(ep0.data));
-        handled = FALSE;
+/* SET_FEATURE and CLEAR_FEATURE. */
+static bool_t set_feature(void)
+{
+    struct usb_device_request *req = &ep0.req;
+    bool_t set = (req->bRequest == USB_REQ_SET_FEATURE);
+
+    switch (USB_RECIP(req->bmRequestType)) {
+    case USB_RECIP_DEVICE:
+        if (req->wValue != USB_FEAT_DEVICE_REMOTE_WAKEUP)
+            break;
+        hw_set_remote_wakeup(set);
+        return TRUE;
+    case USB_RECIP_ENDPOINT:
+        if (req->wValue != USB_FEAT_ENDPOINT_HALT)
+            break;
+        return hw_ep_set_halt(req->wIndex, set);
+    }
 
-    } else if ((req->bmRequestType == 0x80)
-               && (req->bRequest == USB_REQ_GET_STATUS)) {
-
-        /* USB_REQ_GET_STATUS (Device) */
-        ep0.data_len = 2;
-        memset(ep0.data, 0, ep0.data_len);
-
-    } else if ((req->bmRequestType == 0x80)
-               && (req->bRequest == USB_REQ_GET_DESCRIPTOR)) {
-
-        uint8_t type = req->wValue >> 8;
-        uint8_t idx = req->wValue;
-        if ((type == USB_DT_DEVICE) && (idx == 0)) {
-            ep0.data_len = device_descriptor.bLength;
-            memcpy(ep0.data, &device_descriptor, ep0.data_len);
-        } else if ((type == USB_DT_DEVICE_QUALIFIER) && (idx == 0)) {
-            /* No High Speed. */
-            handled = FALSE;
-        } else if ((type == USB_DT_CONFIGURATION) && (idx == 0)) {
-            ep0.data_len = build_configuration_descriptor(ep0.data);
-        } else if ((type == USB_DT_STRING) &&
-                   (idx < ARRAY_SIZE(string_descriptors))) {
-            const char *s = string_descriptors[idx];
-            uint16_t *odat = (uint16_t *)ep0.data;
-            int i = 0;
-            if (idx == 0) {
-                odat[i++] = 4+(USB_DT_STRING<<8);
-                memcpy(&odat[i++], s, 2);
-            } else {
-                odat[i++] = (1+strlen(s))*2+(USB_DT_STRING<<8);
-                while (*s)
-                    odat[i++] = *s++;
-            }
-            ep0.data_len = i*2;
-        } else {
-            WARN("[Unknown device desc %u,%u]\n", type, idx);
-            handled = FALSE;
-        }
+    return FALSE;
+}
+
+static bool_t set_address(void)
+{
+    usb_setaddr(ep0.req.wValue & 0x7f);
+    return TRUE;
+}
+
+static bool_t get_descriptor(void)
+{
+    struct usb_device_request *req = &ep0.req;
+    uint8_t type = req->wValue >> 8;
+    uint8_t idx = req->wValue;
+
+    if ((type == USB_DT_DEVICE) && (idx == 0)) {
+        ep0_send_static(&device_descriptor, device_descriptor.bLength);
+    } else if ((type == USB_DT_DEVICE_QUALIFIER) && (idx == 0)) {
+        /* No High Speed. */
+        return FALSE;
+    } else if ((type == USB_DT_CONFIGURATION) && (idx == 0)) {
+        /* Too large for its buffer: We cannot be configured. */
+        if (config_descriptor_len == 0)
+            return FALSE;
+        ep0_send_static(config_descriptor, config_descriptor_len);
+    } else if ((type == USB_DT_STRING) &&
+               (idx < ARRAY_SIZE(string_descriptors))) {
+        const uint8_t *s = string_descriptors[idx];
+        ep0_send_static(s, s[0]);
+    } else {
+        WARN("[Unknown device desc %u,%u]\n", type, idx);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Control requests are dispatched by a single lookup, on an index formed
+ * from the direction, type (Standard or Class), recipient (Device,
+ * Interface, Endpoint or Other), and request code (0-15) of the request.
+ * Any request outside this space is unsupported. */
+#define REQ_IDX(dir, type, recip, req)                  \
+    ((dir) | ((type) << 6) | ((recip) << 4) | (req))
+#define _REQ_IDX(dir, type, recip, req)                 \
+    REQ_IDX(USB_DIR_##dir, USB_TYPE_##type, USB_RECIP_##recip, req)
+#define REQ(dir, type, recip, req)                      \
+    [_REQ_IDX(dir, type, recip, req)]
+#define REQ_ALL(dir, type, recip)                       \
+    [_REQ_IDX(dir, type, recip, 0) ... _REQ_IDX(dir, type, recip, 15)]
+const static request_handler_t request_handlers[256] = {
+    REQ(IN,  STANDARD, DEVICE,    USB_REQ_GET_STATUS)        = get_status,
+    REQ(IN,  STANDARD, INTERFACE, USB_REQ_GET_STATUS)        = get_status,
+    REQ(IN,  STANDARD, ENDPOINT,  USB_REQ_GET_STATUS)        = get_status,
+    REQ(OUT, STANDARD, DEVICE,    USB_REQ_CLEAR_FEATURE)     = set_feature,
+    REQ(OUT, STANDARD, ENDPOINT,  USB_REQ_CLEAR_FEATURE)     = set_feature,
+    REQ(OUT, STANDARD, DEVICE,    USB_REQ_SET_FEATURE)       = set_feature,
+    REQ(OUT, STANDARD, ENDPOINT,  USB_REQ_SET_FEATURE)       = set_feature,
+    REQ(OUT, STANDARD, DEVICE,    USB_REQ_SET_ADDRESS)       = set_address,
+    REQ(IN,  STANDARD, DEVICE,    USB_REQ_GET_DESCRIPTOR)    = get_descriptor,
+    REQ(OUT, STANDARD, DEVICE,    USB_REQ_SET_CONFIGURATION) =
+        hid_set_configuration,
+    /* Interface descriptors and class requests belong to the HID layer. */
+    REQ(IN,  STANDARD, INTERFACE, USB_REQ_GET_DESCRIPTOR)    =
+        hid_get_descriptor,
+    REQ_ALL(IN,  CLASS, INTERFACE) = hid_handle_class_request,
+    REQ_ALL(OUT, CLASS, INTERFACE) = hid_handle_class_request
+};
 
-    } else if ((req->bmRequestType == 0x81)
-               && (req->bRequest == USB_REQ_GET_DESCRIPTOR)) {
+static request_handler_t request_handler(const struct usb_device_request *req)
+{
+    uint8_t type = USB_TYPE(req->bmRequestType);
+    uint8_t recip = USB_RECIP(req->bmRequestType);
 
-        handled = hid_get_descriptor();
+    if ((type > USB_TYPE_CLASS) || (recip > 3) || (req->bRequest > 15))
+        return NULL;
 
-    } else if ((req->bmRequestType == 0x00)
-               && (req->bRequest == USB_REQ_SET_ADDRESS)) {
+    return request_handlers[REQ_IDX(req->bmRequestType & USB_DIR_IN,
+                                    type, recip, req->bRequest)];
+}
 
-        usb_setaddr(req->wValue & 0x7f);
+static bool_t handle_control_request(void)
+{
+    struct usb_device_request *req = &ep0.req;
+    request_handler_t handler;
+    bool_t handled;
 
-    } else if ((req->bmRequestType == 0x00)
-              && (req->bRequest == USB_REQ_SET_CONFIGURATION)) {
+    if (ep0_data_out() && (req->wLength > sizeof(ep0.data))) {
 
-        handled = hid_set_configuration();
+        WARN("Ctl OUT too long: %u>%u\n", req->wLength, sizeof(ep0.data));
+        handled = FALSE;
 
-    } else if ((req->bmRequestType&0x7f) == 0x21) {
+    } else if ((handler = request_handler(req)) != NULL) {
 
-        handled = hid_handle_class_request();
+        handled = (*handler)();
 
     } else {
 
@@ -155,6 +259,7 @@ static void usb_write_ep0(void)
 
     len = min_t(uint32_t, ep0.tx.todo, EP0_MPS);
     usb_write(0, ep0.tx.p, len);
+    ep0.tx.len = len;
 
     ep0.tx.p += len;
     ep0.tx.todo -= len;
@@ -177,8 +282,10 @@ void handle_rx_ep0(bool_t is_setup)
 
         /* Control Transfer: Setup Stage. */
         ep0.data_len = 0;
+        ep0.tx.p = ep0.data;
         ep0.tx.todo = -1;
         usb_read(ep, &ep0.req, sizeof(ep0.req));
+        usb_log_setup(&ep0.req);
         ready = ep0_data_in() || (ep0.req.wLength == 0);
 
     } else if (ep0.data_len < 0) {
@@ -192,6 +299,7 @@ void handle_rx_ep0(bool_t is_setup)
         /* OUT Control Transfer: Data from Host. */
         uint32_t len = ep_rx_ready(ep);
         int l = 0;
+        usb_log(SAMISARA_USBLOG_OUT, ep, len);
         if (ep0.data_len < sizeof(ep0.data))
             l = min_t(int, sizeof(ep0.data)-ep0.data_len, len);
         usb_read(ep, &ep0.data[ep0.data_len], l);
@@ -205,6 +313,7 @@ void handle_rx_ep0(bool_t is_setup)
 
         /* IN Control Transfer: Status from Host. */
         usb_read(ep, NULL, 0);
+        usb_log(SAMISARA_USBLOG_STATUS, ep, 0);
         ep0.tx.todo = -1;
         ep0.data_len = -1; /* Complete */
 
@@ -223,8 +332,8 @@ void handle_rx_ep0(bool_t is_setup)
 
     } else if (ep0_data_in()) {
 
-        /* IN Control Transfer: Send Data to Host. */
-        ep0.tx.p = ep0.data;
+        /* IN Control Transfer: Send Data to Host, from ep0.data unless the
+         * request handler redirected ep0.tx.p. */
         ep0.tx.todo = ep0.data_len;
         ep0.tx.trunc = (ep0.data_len < ep0.req.wLength);
         usb_write_ep0();
@@ -243,6 +352,11 @@ void handle_rx_ep0(bool_t is_setup)
 
 void handle_tx_ep0(void)
 {
+    /* The Status stage of an OUT Control Transfer is sent from NULL. */
+    if (ep0.tx.p == NULL)
+        usb_log(SAMISARA_USBLOG_STATUS, USB_DIR_IN, 0);
+    else
+        usb_log(SAMISARA_USBLOG_IN, USB_DIR_IN, ep0.tx.len);
     usb_write_ep0();
 }
 
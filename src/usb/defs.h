@@ -9,6 +9,18 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
+/* bmRequestType */
+#define USB_DIR_OUT                 0x00
+#define USB_DIR_IN                  0x80
+#define USB_TYPE(x)                 (((x)>>5)&3)
+#define USB_TYPE_STANDARD           0
+#define USB_TYPE_CLASS              1
+#define USB_TYPE_VENDOR             2
+#define USB_RECIP(x)                ((x)&0x1f)
+#define USB_RECIP_DEVICE            0
+#define USB_RECIP_INTERFACE         1
+#define USB_RECIP_ENDPOINT          2
+
 /* bRequest: Standard Request Codes */
 #define USB_REQ_GET_STATUS          0
 #define USB_REQ_CLEAR_FEATURE       1
@@ -22,6 +34,10 @@
 #define USB_REQ_SET_INTERFACE      11
 #define USB_REQ_SYNCH_FRAME        12
 
+/* wValue: Standard Feature Selectors */
+#define USB_FEAT_ENDPOINT_HALT      0
+#define USB_FEAT_DEVICE_REMOTE_WAKEUP 1
+
 /* Descriptor Types */
 #define USB_DT_DEVICE               1
 #define USB_DT_CONFIGURATION        2
@@ -94,6 +110,19 @@ struct packed usb_hid_descriptor {
     uint16_t wReportDescriptorLength;
 };
 
+/* Define string descriptor @name for literal @s, which the compiler encodes
+ * as UTF-16. bLength counts the NUL terminator in place of the header. */
+#define USB_STRING_DESCRIPTOR(name, s)          \
+const static struct packed {                    \
+    uint8_t bLength;                            \
+    uint8_t bDescriptorType;                    \
+    uint16_t wString[sizeof(u"" s)/2 - 1];      \
+} name aligned(2) = {                           \
+    .bLength = sizeof(u"" s),                   \
+    .bDescriptorType = USB_DT_STRING,           \
+    .wString = u"" s                            \
+}
+
 struct packed usb_device_request {
     uint8_t bmRequestType;
     uint8_t bRequest;
@@ -109,32 +138,68 @@ extern struct ep0 {
     uint8_t data[128];
     int data_len;
     struct {
-        const uint8_t *p;
+        const uint8_t *p; /* ep0.data, or see ep0_send_static() */
         int todo;
+        uint16_t len; /* Packet in flight */
         bool_t trunc;
     } tx;
 } ep0;
 #define ep0_data_out() (!(ep0.req.bmRequestType & 0x80))
 #define ep0_data_in()  (!ep0_data_out())
 
+/* Send the IN data stage straight from @p rather than from ep0.data, in
+ * EP0_MPS chunks. @p must remain valid until the transfer completes (eg.
+ * const data in flash), and be 2-byte aligned. @len is unlimited. */
+void ep0_send_static(const void *p, unsigned int len);
+
+/* Handler of a control request, which is found in ep0.req. Returns FALSE
+ * to STALL the request. */
+typedef bool_t (*request_handler_t)(void);
+
 /* USB HID */
 bool_t hid_handle_class_request(void);
 bool_t hid_get_descriptor(void);
 bool_t hid_set_configuration(void);
-unsigned int hid_build_configuration_descriptor(uint8_t *dat);
+void hid_bus_reset(void);
+unsigned int hid_build_configuration_descriptor(uint8_t *dat,
+                                                unsigned int max);
 
 /* USB Core */
 void handle_rx_ep0(bool_t is_setup);
 void handle_tx_ep0(void);
 
+/* USB Flight Recorder: Log an event (SAMISARA_USBLOG_*) on endpoint @ep,
+ * or a Setup packet. Thread context only. */
+void usb_log(uint8_t type, uint8_t ep, uint16_t len);
+void usb_log_setup(const struct usb_device_request *req);
+void usb_log_freeze(bool_t frozen);
+void usb_log_get(uint16_t first, struct samisara_subreport_usblog *log);
+
 /* USB Hardware */
 enum { EPT_CONTROL=0, EPT_ISO, EPT_BULK, EPT_INTERRUPT, EPT_DBLBUF };
+#define USB_NR_EP 4 /* Endpoints supported by every driver, including EP0 */
+/* Configure an endpoint, allocating it @size bytes of packet-buffer memory
+ * (PMA or TX FIFO). */
 void usb_configure_ep(uint8_t ep, uint8_t type, uint32_t size);
+/* Disable all endpoints except EP0, and free their packet-buffer memory. */
+void usb_deconfigure(void);
 void usb_stall(uint8_t ep);
 void usb_setaddr(uint8_t addr);
 void hw_usb_init(void);
 void hw_usb_deinit(void);
 bool_t hw_has_highspeed(void);
+void hw_set_remote_wakeup(bool_t enable);
+bool_t hw_remote_wakeup_enabled(void);
+/* ENDPOINT_HALT of a configured IN endpoint (@ep includes the direction
+ * bit). EP0 is never halted, and cannot be. Return FALSE for any other
+ * endpoint. */
+bool_t hw_ep_set_halt(uint8_t ep, bool_t halt);
+bool_t hw_ep_get_halt(uint8_t ep, bool_t *p_halt);
+
+/* USB Hardware: Bus events raised by the drivers. */
+void handle_bus_reset(void);
+void handle_suspend(void);
+void handle_resume(void);
 
 struct usb_driver {
     void (*init)(void);
@@ -147,11 +212,24 @@ struct usb_driver {
     void (*setaddr)(uint8_t addr);
 
     void (*configure_ep)(uint8_t epnr, uint8_t type, uint32_t size);
+    void (*deconfigure)(void);
     int (*ep_rx_ready)(uint8_t epnr);
     bool_t (*ep_tx_ready)(uint8_t epnr);
+    time_t (*ep_tx_time)(uint8_t epnr);
     void (*read)(uint8_t epnr, void *buf, uint32_t len);
     void (*write)(uint8_t epnr, const void *buf, uint32_t len);
     void (*stall)(uint8_t epnr);
+
+    /* Set or clear the ENDPOINT_HALT feature of an IN endpoint. Clearing it
+     * resets the data toggle. */
+    void (*halt)(uint8_t epnr, bool_t halt);
+
+    /* Start or stop driving resume signalling (K state) on the bus. */
+    void (*resume_signal)(bool_t on);
+
+    /* Interrupt line raised on device events. Its handler only posts
+     * WORK_USB: the events are handled by process(). */
+    uint8_t irq;
 };
 
 extern const struct usb_driver dwc_otg;
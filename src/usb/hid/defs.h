@@ -33,15 +33,34 @@
 static inline void TRC(const char *format, ...) { }
 #endif
 
+/* An endpoint required by an interface. Endpoints are numbered in registry
+ * order when the configuration descriptor is built, and are allocated
+ * packet-buffer space of @mps bytes on SET_CONFIGURATION. */
+struct endpoint {
+    uint8_t dir;      /* USB_DIR_IN or USB_DIR_OUT */
+    uint8_t type;     /* EPT_* */
+    uint16_t mps;     /* wMaxPacketSize */
+    uint8_t interval; /* bInterval, or 0 to use config.poll_ms */
+    uint8_t *nr;      /* Allocated endpoint number */
+};
+
+/* A HID interface of the composite device. Interfaces are numbered by their
+ * position in the registry (hid.c), from which their interface, HID and
+ * endpoint descriptors are generated. */
 struct interface {
     const char *name;
+    uint8_t subclass, protocol; /* bInterfaceSubClass, bInterfaceProtocol */
     const uint8_t *report_descriptor;
     unsigned int report_descriptor_length;
-    unsigned int (*build_configuration_descriptor)(uint8_t *);
+    const struct endpoint *eps;
+    unsigned int nr_eps;
+    /* Reset class state to its defaults on bus reset (optional). */
+    void (*reset)(void);
+    /* Reset class state. Called on SET_CONFIGURATION, once the endpoints
+     * are configured. */
     void (*initialise)(void);
-    bool_t (*handle_report)(struct usb_device_request *);
-    bool_t (*handle_idle)(struct usb_device_request *);
-    bool_t (*handle_protocol)(struct usb_device_request *);
+    /* Class request handlers, indexed by HID_REQ_* (Get and Set). */
+    bool_t (*handle[HID_REQ_PROTOCOL+1])(struct usb_device_request *);
 };
 
 extern const struct interface interface_keyboard;
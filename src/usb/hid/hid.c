@@ -9,16 +9,24 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
-const static struct interface *interfaces[2] = {
-    [0] = &interface_keyboard,
-    [1] = &interface_vendor
+/* Interface registry: bInterfaceNumber is the index into this array. */
+const static struct interface *interfaces[] = {
+    &interface_keyboard,
+    &interface_vendor
+};
+
+const static char hid_req_name[][9] = {
+    [HID_REQ_REPORT] = "Report",
+    [HID_REQ_IDLE] = "Idle",
+    [HID_REQ_PROTOCOL] = "Protocol"
 };
 
 bool_t hid_handle_class_request(void)
 {
     const struct interface *intf = NULL;
     struct usb_device_request *req = &ep0.req;
-    bool_t handled = FALSE;
+    bool_t (*handler)(struct usb_device_request *) = NULL;
+    uint8_t r = req->bRequest & ~HID_REQ_SET;
 
     if (req->wIndex < ARRAY_SIZE(interfaces))
         intf = interfaces[req->wIndex];
@@ -30,47 +38,17 @@ bool_t hid_handle_class_request(void)
         return FALSE;
     }
 
-    TRC("req=%02x/%s_", req->bRequest,
-        (req->bRequest & HID_REQ_SET) ? "Set" : "Get");
-
-    switch (req->bRequest & ~HID_REQ_SET) {
-
-    case HID_REQ_REPORT: {
-        TRC("Report val=%04x len=%04x: ", req->wValue, req->wLength);
-        if (intf->handle_report == NULL)
-            goto no_handler;
-        handled = intf->handle_report(req);
-        break;
-    }
-
-    case HID_REQ_IDLE: {
-        TRC("Idle val=%04x: ", req->wValue);
-        if (intf->handle_idle == NULL)
-            goto no_handler;
-        handled = intf->handle_idle(req);
-        break;
-    }
-
-    case HID_REQ_PROTOCOL: {
-        TRC("Protocol val=%04x: ", req->wValue);
-        if (intf->handle_protocol == NULL)
-            goto no_handler;
-        handled = intf->handle_idle(req);
-        break;
-    }
-
-    default:
-        TRC("???: Unknown req\n", req->bRequest);
-        handled = FALSE;
-        break;
-
+    if (r < ARRAY_SIZE(intf->handle))
+        handler = intf->handle[r];
+    if (handler == NULL) {
+        TRC("req=%02x: No handler\n", req->bRequest);
+        return FALSE;
     }
 
-    return handled;
-
-no_handler:
-    TRC("No handler\n");
-    return FALSE;
+    TRC("req=%02x/%s_%s val=%04x len=%04x: ", req->bRequest,
+        (req->bRequest & HID_REQ_SET) ? "Set" : "Get", hid_req_name[r],
+        req->wValue, req->wLength);
+    return (*handler)(req);
 }
 
 bool_t hid_get_descriptor(void)
@@ -99,8 +77,8 @@ bool_t hid_get_descriptor(void)
             TRC("Bad index %u\n", idx);
             return FALSE;
         }
-        ep0.data_len = intf->report_descriptor_length;
-        memcpy(ep0.data, intf->report_descriptor, ep0.data_len);
+        ep0_send_static(intf->report_descriptor,
+                        intf->report_descriptor_length);
         TRC("%d bytes\n", ep0.data_len);
         break;
     default:
@@ -113,35 +91,128 @@ bool_t hid_get_descriptor(void)
 
 bool_t hid_set_configuration(void)
 {
-    int i;
-
-    for (i = 0; i < ARRAY_SIZE(interfaces); i++)
-        interfaces[i]->initialise();
+    const struct interface *intf;
+    const struct endpoint *ep;
+    int i, j;
+
+    /* Release the endpoints of any previous configuration, then allocate
+     * each registered endpoint its packet buffers. */
+    usb_deconfigure();
+    for (i = 0; i < ARRAY_SIZE(interfaces); i++) {
+        intf = interfaces[i];
+        for (j = 0; j < intf->nr_eps; j++) {
+            ep = &intf->eps[j];
+            usb_configure_ep(ep->dir | *ep->nr, ep->type, ep->mps);
+        }
+        intf->initialise();
+    }
 
     usb_class_ops.configure();
 
     return TRUE;
 }
 
+/* Class state reverts to its defaults on bus reset, as on power-on. */
+void hid_bus_reset(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(interfaces); i++)
+        if (interfaces[i]->reset != NULL)
+            interfaces[i]->reset();
+}
+
 const static struct usb_configuration_descriptor config_descriptor aligned(2) = {
     .bLength = sizeof(struct usb_configuration_descriptor),
     .bDescriptorType = USB_DT_CONFIGURATION,
-    .bNumInterfaces = 2,
+    .bNumInterfaces = ARRAY_SIZE(interfaces),
     .bConfigurationValue = 1,
     .bmAttributes = 0xa0, /* Bus powered, Remote Wakeup */
     .bMaxPower = 50 /* 100mA */
 };
 
-unsigned int hid_build_configuration_descriptor(uint8_t *dat)
+static uint8_t *build_interface_descriptor(
+    uint8_t *p, uint8_t nr, const struct interface *intf)
 {
-    uint8_t *p = dat;
-    int i;
+    struct usb_interface_descriptor *id;
+    struct usb_hid_descriptor *hd;
+
+    id = (struct usb_interface_descriptor *)p;
+    memset(id, 0, sizeof(*id));
+    id->bLength = sizeof(*id);
+    id->bDescriptorType = USB_DT_INTERFACE;
+    id->bInterfaceNumber = nr;
+    id->bNumEndpoints = intf->nr_eps;
+    id->bInterfaceClass = 3; /* HID */
+    id->bInterfaceSubClass = intf->subclass;
+    id->bInterfaceProtocol = intf->protocol;
+    p += sizeof(*id);
+
+    hd = (struct usb_hid_descriptor *)p;
+    memset(hd, 0, sizeof(*hd));
+    hd->bLength = sizeof(*hd);
+    hd->bDescriptorType = HID_DT;
+    hd->bcdHID = 0x0110; /* 1.10 */
+    hd->bNumDescriptors = 1;
+    hd->bReportDescriptorType = HID_DT_REPORT;
+    hd->wReportDescriptorLength = intf->report_descriptor_length;
+    p += sizeof(*hd);
+
+    return p;
+}
+
+static uint8_t *build_endpoint_descriptor(
+    uint8_t *p, uint8_t nr, const struct endpoint *ep)
+{
+    struct usb_endpoint_descriptor *ed;
+
+    ed = (struct usb_endpoint_descriptor *)p;
+    ed->bLength = sizeof(*ed);
+    ed->bDescriptorType = USB_DT_ENDPOINT;
+    ed->bEndpointAddress = ep->dir | nr;
+    ed->bmAttributes = (ep->type == EPT_DBLBUF) ? EPT_BULK : ep->type;
+    ed->wMaxPacketSize = ep->mps;
+    ed->bInterval = ep->interval ? ep->interval : config.poll_ms;
+    p += sizeof(*ed);
+
+    return p;
+}
+
+/* Also allocates endpoint numbers, in registry order. Returns 0, having
+ * written nothing to @dat, if the descriptor would exceed @max bytes. */
+unsigned int hid_build_configuration_descriptor(uint8_t *dat,
+                                                unsigned int max)
+{
+    const struct interface *intf;
+    const struct endpoint *ep;
+    unsigned int sz = sizeof(config_descriptor);
+    uint8_t *p = dat, nr = 1;
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(interfaces); i++) {
+        intf = interfaces[i];
+        sz += sizeof(struct usb_interface_descriptor)
+            + sizeof(struct usb_hid_descriptor);
+        for (j = 0; j < intf->nr_eps; j++) {
+            ASSERT(nr < USB_NR_EP);
+            *intf->eps[j].nr = nr++;
+            sz += sizeof(struct usb_endpoint_descriptor);
+        }
+    }
+    if (sz > max)
+        return 0;
 
     memcpy(p, &config_descriptor, sizeof(config_descriptor));
     p += sizeof(config_descriptor);
 
-    for (i = 0; i < ARRAY_SIZE(interfaces); i++)
-        p += interfaces[i]->build_configuration_descriptor(p);
+    for (i = 0; i < ARRAY_SIZE(interfaces); i++) {
+        intf = interfaces[i];
+        p = build_interface_descriptor(p, i, intf);
+        for (j = 0; j < intf->nr_eps; j++) {
+            ep = &intf->eps[j];
+            p = build_endpoint_descriptor(p, *ep->nr, ep);
+        }
+    }
 
     return p - dat;
 }
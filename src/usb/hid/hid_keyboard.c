@@ -13,17 +13,31 @@ static struct kbd_state {
     uint8_t led;
     uint8_t idle;
     uint8_t protocol;
-} kbd_state, default_kbd_state = { 0, 0, 1 };
+} kbd_state, default_kbd_state = {
+    .idle = 125, /* 500ms: the HID default for keyboards */
+    .protocol = KBD_PROTOCOL_REPORT
+};
 
 uint8_t kbd_led(void)
 {
     return kbd_state.led;
 }
 
+uint8_t kbd_protocol(void)
+{
+    return kbd_state.protocol;
+}
+
+uint8_t kbd_idle_rate(void)
+{
+    return kbd_state.idle;
+}
+
+uint8_t ep_tx;
+
 static void kbd_initialise(void)
 {
     kbd_state = default_kbd_state;
-    usb_configure_ep(0x81, EPT_INTERRUPT, USB_FS_MPS);
 }
 
 static bool_t kbd_report_leds(struct usb_device_request *req)
@@ -79,52 +93,26 @@ static bool_t kbd_handle_protocol(struct usb_device_request *req)
     return TRUE;
 }
 
-const static struct usb_interface_descriptor kbd_interface_descriptor aligned(2) = {
-    .bLength = sizeof(struct usb_interface_descriptor),
-    .bDescriptorType = USB_DT_INTERFACE,
-    .bInterfaceNumber = 0,
-    .bNumEndpoints = 1,
-    .bInterfaceClass = 3, /* HID */
-    .bInterfaceSubClass = 1, /* Boot Interface */
-    .bInterfaceProtocol = 1 /* Keyboard */
+/* Report Protocol and Boot Protocol reports. bInterval is config.poll_ms. */
+const static struct endpoint kbd_eps[] = {
+    { .dir = USB_DIR_IN, .type = EPT_INTERRUPT, .mps = 32, .nr = &ep_tx }
 };
 
-const static struct usb_endpoint_descriptor kbd_endpoint_descriptor aligned(2) = {
-    .bLength = sizeof(struct usb_endpoint_descriptor),
-    .bDescriptorType = USB_DT_ENDPOINT,
-    .bEndpointAddress = 0x81,
-    .bmAttributes = 0x03, /* Interrupt */
-    .wMaxPacketSize = 8,
-    .bInterval = 10 /* 10ms */
-};
-
-const static struct usb_hid_descriptor kbd_hid_descriptor aligned(2) = {
-    .bLength = sizeof(struct usb_hid_descriptor),
-    .bDescriptorType = HID_DT,
-    .bcdHID = 0x0110, /* 1.10 */
-    .bNumDescriptors = 1,
-    .bReportDescriptorType = HID_DT_REPORT,
-    .wReportDescriptorLength = 63
-};
-
-/* This is the bog standard 6KRO keyboard report, compatible with the
- * Keyboard Boot Protocol. It's straight out of the spec, and all basic
- * keyboards use this as is or with tiny tweaks. */
+/* Report Protocol: An N-key rollover bitmap covering all usages 0x00-0xE7,
+ * including the modifiers. Hosts using the Keyboard Boot Protocol ignore
+ * this descriptor, and are sent the standard 6KRO boot report instead. */
 const static uint8_t kbd_hid_report[] aligned(2) = {
     0x05, 0x01, /* Usage Page (Generic Desktop) */
     0x09, 0x06, /* Usage (Keyboard) */
     0xa1, 0x01, /* Collection (Application) */
     0x05, 0x07, /* Usage Page (Keyboard/Keypad) */
-    0x19, 0xe0, /* Usage Minimum (224) */
+    0x19, 0x00, /* Usage Minimum (0) */
     0x29, 0xe7, /* Usage Maximum (231) */
     0x15, 0x00, /* Logical Minimum (0) */
     0x25, 0x01, /* Logical Maximum (1) */
     0x75, 0x01, /* Report Size (1) */
-    0x95, 0x08, /* Report Count (8) */
-    0x81, 0x02, /* Input (Data, Variable, Absolute) ; Modifier */
-    0x95, 0x01, /* Report Count (1) */
-    0x75, 0x08, /* Report Size (8) */
-    0x81, 0x01, /* Input (Constant) ; Reserved bytes */
+    0x95, 0xe8, /* Report Count (232) */
+    0x81, 0x02, /* Input (Data, Variable, Absolute) ; Key bitmap */
     0x95, 0x05, /* Report Count (5) */
     0x75, 0x01, /* Report Size (1) */
     0x05, 0x08, /* Usage Page (LEDs) */
@@ -134,38 +122,24 @@ const static uint8_t kbd_hid_report[] aligned(2) = {
     0x95, 0x01, /* Report Count (1) */
     0x75, 0x03, /* Report Size (3) */
     0x91, 0x01, /* Output (Constant) ; LED report padding */
-    0x95, 0x06, /* Report Count (6) */
-    0x75, 0x08, /* Report Size (8) */
-    0x15, 0x00, /* Logical Minimum (0) */
-    0x25, 0x65, /* Logical Maximum (101) */
-    0x05, 0x07, /* Usage Page (Keyboard/Keypad) */
-    0x19, 0x00, /* Usage Minimum (0) */
-    0x29, 0x65, /* Usage Maximum (101) */
-    0x81, 0x00, /* Input (Data, Array) ; Key arrays (6 bytes) */
     0xc0        /* End Collection */
 };
 
-unsigned int kbd_build_configuration_descriptor(uint8_t *dat)
-{
-    uint8_t *p = dat;
-    memcpy(p, &kbd_interface_descriptor, sizeof(kbd_interface_descriptor));
-    p += sizeof(kbd_interface_descriptor);
-    memcpy(p, &kbd_hid_descriptor, sizeof(kbd_hid_descriptor));
-    p += sizeof(kbd_hid_descriptor);
-    memcpy(p, &kbd_endpoint_descriptor, sizeof(kbd_endpoint_descriptor));
-    p += sizeof(kbd_endpoint_descriptor);
-    return p - dat;
-}
-
 const struct interface interface_keyboard = {
     .name = "Keyboard",
+    .subclass = 1, /* Boot Interface */
+    .protocol = 1, /* Keyboard */
     .report_descriptor = kbd_hid_report,
     .report_descriptor_length = sizeof(kbd_hid_report),
-    .build_configuration_descriptor = kbd_build_configuration_descriptor,
+    .eps = kbd_eps,
+    .nr_eps = ARRAY_SIZE(kbd_eps),
+    .reset = kbd_initialise,
     .initialise = kbd_initialise,
-    .handle_report = kbd_handle_report,
-    .handle_idle = kbd_handle_idle,
-    .handle_protocol = kbd_handle_protocol
+    .handle = {
+        [HID_REQ_REPORT] = kbd_handle_report,
+        [HID_REQ_IDLE] = kbd_handle_idle,
+        [HID_REQ_PROTOCOL] = kbd_handle_protocol
+    }
 };
 
 /*
@@ -12,16 +12,19 @@
 static struct vdr_state {
     uint8_t idle;
     uint16_t subreport;
+    uint16_t subreport_arg;
     uint16_t cmd_result;
 } vdr_state, default_vdr_state = { 0 };
 
 #define SAMISARA_VINTF_REPORT_ID 0x01
 #define SAMISARA_VINTF_REPORT_SZ 48
 
+uint8_t ep_telemetry;
+
 static void vdr_initialise(void)
 {
     vdr_state = default_vdr_state;
-    usb_configure_ep(0x82, EPT_INTERRUPT, USB_FS_MPS);
+    telemetry_start();
 }
 
 static bool_t vdr_cmd(uint8_t *data)
@@ -40,13 +43,15 @@ static bool_t vdr_cmd(uint8_t *data)
     switch (cmd) {
 
     case SAMISARA_CMD_SUBREPORT: {
-        struct samisara_cmd_subreport cmd_subreport;
-        if (len != sizeof(cmd_subreport))
+        struct samisara_cmd_subreport cmd_subreport = { 0 };
+        if ((len != sizeof(cmd_subreport))
+            && (len != offsetof(struct samisara_cmd_subreport, arg)))
             goto bad_cmd;
         memcpy(&cmd_subreport, p, len);
         if (cmd_subreport.idx > SAMISARA_SUBREPORT_MAX)
             goto bad_cmd;
         vdr_state.subreport = cmd_subreport.idx;
+        vdr_state.subreport_arg = cmd_subreport.arg;
         break;
     }
 
@@ -61,6 +66,113 @@ static bool_t vdr_cmd(uint8_t *data)
         break;
     }
 
+    case SAMISARA_CMD_CALIBRATE: {
+        if (len != 0)
+            goto bad_cmd;
+        keyboard_calibrate();
+        break;
+    }
+
+    case SAMISARA_CMD_DEBOUNCE: {
+        struct samisara_cmd_debounce cmd_debounce;
+        if (len != sizeof(cmd_debounce))
+            goto bad_cmd;
+        memcpy(&cmd_debounce, p, len);
+        if (!keyboard_set_debounce(&cmd_debounce))
+            goto bad_cmd;
+        break;
+    }
+
+    case SAMISARA_CMD_IDLE: {
+        struct samisara_cmd_idle cmd_idle;
+        if (len != sizeof(cmd_idle))
+            goto bad_cmd;
+        memcpy(&cmd_idle, p, len);
+        keyboard_set_idle_timeout(cmd_idle.timeout_ms);
+        break;
+    }
+
+    case SAMISARA_CMD_STATS_RESET: {
+        if (len != 0)
+            goto bad_cmd;
+        stats_reset();
+        keyboard_reset_latency();
+        break;
+    }
+
+    case SAMISARA_CMD_KEYMAP: {
+        struct samisara_cmd_keymap cmd_keymap;
+        const unsigned int hdr = offsetof(struct samisara_cmd_keymap, usage);
+        if ((len < hdr) || (len > sizeof(cmd_keymap)))
+            goto bad_cmd;
+        memcpy(&cmd_keymap, p, len);
+        if ((len != hdr + cmd_keymap.nr) || !keyboard_set_keymap(&cmd_keymap))
+            goto bad_cmd;
+        break;
+    }
+
+    case SAMISARA_CMD_MACRO: {
+        struct samisara_cmd_macro cmd_macro;
+        const unsigned int hdr = offsetof(struct samisara_cmd_macro, step);
+        if ((len < hdr) || (len > sizeof(cmd_macro)))
+            goto bad_cmd;
+        memcpy(&cmd_macro, p, len);
+        if ((len != hdr + cmd_macro.nr * sizeof(cmd_macro.step[0]))
+            || !keyboard_set_macro(&cmd_macro))
+            goto bad_cmd;
+        break;
+    }
+
+    case SAMISARA_CMD_POLL: {
+        struct samisara_cmd_poll cmd_poll;
+        if (len != sizeof(cmd_poll))
+            goto bad_cmd;
+        memcpy(&cmd_poll, p, len);
+        switch (cmd_poll.interval_ms) {
+        case 1: case 2: case 4: case 8: case 10:
+            break;
+        default:
+            goto bad_cmd;
+        }
+        if (cmd_poll.interval_ms != config.poll_ms) {
+            config.poll_ms = cmd_poll.interval_ms;
+            work_post(WORK_CONFIG);
+            usb_reconnect();
+        }
+        break;
+    }
+
+    case SAMISARA_CMD_CONFIG_SAVE: {
+        if (len != 0)
+            goto bad_cmd;
+        work_post(WORK_CONFIG);
+        break;
+    }
+
+    case SAMISARA_CMD_CONFIG_RESET: {
+        struct samisara_cmd_config_reset cmd_reset = {
+            .sections = SAMISARA_CONFIG_ALL };
+        uint8_t poll_ms = config.poll_ms;
+        if ((len != 0) && (len != sizeof(cmd_reset)))
+            goto bad_cmd;
+        memcpy(&cmd_reset, p, len);
+        if (cmd_reset.sections & ~SAMISARA_CONFIG_ALL)
+            goto bad_cmd;
+        config_reset(cmd_reset.sections);
+        if (config.poll_ms != poll_ms)
+            usb_reconnect();
+        break;
+    }
+
+    case SAMISARA_CMD_USBLOG: {
+        struct samisara_cmd_usblog cmd_usblog;
+        if (len != sizeof(cmd_usblog))
+            goto bad_cmd;
+        memcpy(&cmd_usblog, p, len);
+        usb_log_freeze(!!cmd_usblog.frozen);
+        break;
+    }
+
     default:
     bad_cmd:
         vdr_state.cmd_result = SAMISARA_RESULT_BAD_CMD;
@@ -102,6 +214,123 @@ static bool_t vdr_subreport(uint8_t *data)
         break;
     }
 
+    case SAMISARA_SUBREPORT_SETTLE: {
+        struct samisara_subreport_settle settle;
+        keyboard_get_settle(&settle);
+        len = sizeof(settle);
+        memcpy(p, &settle, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_DEBOUNCE: {
+        struct samisara_cmd_debounce debounce;
+        keyboard_get_debounce(&debounce);
+        len = sizeof(debounce);
+        memcpy(p, &debounce, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_IDLE: {
+        struct samisara_subreport_idle idle;
+        keyboard_get_idle(&idle);
+        len = sizeof(idle);
+        memcpy(p, &idle, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_GHOST: {
+        struct samisara_subreport_ghost ghost;
+        keyboard_get_ghost(&ghost);
+        len = sizeof(ghost);
+        memcpy(p, &ghost, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_EVENTS: {
+        struct samisara_subreport_events events;
+        keyboard_get_events(&events);
+        len = sizeof(events);
+        memcpy(p, &events, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_STATS: {
+        struct samisara_subreport_stats stats;
+        if (!stats_get(vdr_state.subreport_arg, &stats))
+            return FALSE;
+        len = sizeof(stats);
+        memcpy(p, &stats, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_STATS_HIST: {
+        struct samisara_subreport_stats_hist hist;
+        if (!stats_get_hist(vdr_state.subreport_arg & 0xff,
+                            vdr_state.subreport_arg >> 8, &hist))
+            return FALSE;
+        len = sizeof(hist);
+        memcpy(p, &hist, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_KEYMAP: {
+        struct samisara_cmd_keymap keymap;
+        keymap.layer = vdr_state.subreport_arg & 0xff;
+        keymap.first = vdr_state.subreport_arg >> 8;
+        if ((keymap.layer >= SAMISARA_KEYMAP_LAYERS)
+            || (keymap.first >= SAMISARA_KEYMAP_KEYS))
+            return FALSE;
+        keymap.nr = min_t(unsigned int, sizeof(keymap.usage),
+                          SAMISARA_KEYMAP_KEYS - keymap.first);
+        memcpy(keymap.usage, &config.keymap[keymap.layer][keymap.first],
+               keymap.nr);
+        len = offsetof(struct samisara_cmd_keymap, usage) + keymap.nr;
+        memcpy(p, &keymap, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_LATENCY: {
+        struct samisara_subreport_latency latency;
+        keyboard_get_latency(&latency);
+        len = sizeof(latency);
+        memcpy(p, &latency, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_POLL: {
+        struct samisara_cmd_poll poll = { .interval_ms = config.poll_ms };
+        len = sizeof(poll);
+        memcpy(p, &poll, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_MACRO: {
+        struct samisara_cmd_macro macro;
+        macro.macro = vdr_state.subreport_arg & 0xff;
+        macro.first = vdr_state.subreport_arg >> 8;
+        if ((macro.macro >= SAMISARA_NR_MACROS)
+            || (macro.first >= SAMISARA_MACRO_STEPS))
+            return FALSE;
+        macro.nr = min_t(unsigned int, ARRAY_SIZE(macro.step),
+                         SAMISARA_MACRO_STEPS - macro.first);
+        memcpy(macro.step, &config.macro[macro.macro][macro.first],
+               macro.nr * sizeof(macro.step[0]));
+        len = offsetof(struct samisara_cmd_macro, step)
+            + macro.nr * sizeof(macro.step[0]);
+        memcpy(p, &macro, len);
+        break;
+    }
+
+    case SAMISARA_SUBREPORT_USBLOG: {
+        struct samisara_subreport_usblog usblog;
+        BUILD_BUG_ON(sizeof(usblog) > SAMISARA_VINTF_REPORT_SZ - 2);
+        usb_log_get(vdr_state.subreport_arg, &usblog);
+        len = offsetof(struct samisara_subreport_usblog, rec)
+            + usblog.nr * sizeof(usblog.rec[0]);
+        memcpy(p, &usblog, len);
+        break;
+    }
+
     default:
         return FALSE;
 
@@ -170,30 +399,11 @@ static bool_t vdr_handle_idle(struct usb_device_request *req)
     return TRUE;
 }
 
-const static struct usb_interface_descriptor vdr_interface_descriptor aligned(2) = {
-    .bLength = sizeof(struct usb_interface_descriptor),
-    .bDescriptorType = USB_DT_INTERFACE,
-    .bInterfaceNumber = 1,
-    .bNumEndpoints = 1,
-    .bInterfaceClass = 3, /* HID */
-};
-
-const static struct usb_endpoint_descriptor vdr_endpoint_descriptor aligned(2) = {
-    .bLength = sizeof(struct usb_endpoint_descriptor),
-    .bDescriptorType = USB_DT_ENDPOINT,
-    .bEndpointAddress = 0x82,
-    .bmAttributes = 0x03, /* Interrupt */
-    .wMaxPacketSize = 8,
-    .bInterval = 255 /* max */
-};
-
-const static struct usb_hid_descriptor vdr_hid_descriptor aligned(2) = {
-    .bLength = sizeof(struct usb_hid_descriptor),
-    .bDescriptorType = HID_DT,
-    .bcdHID = 0x0110, /* 1.10 */
-    .bNumDescriptors = 1,
-    .bReportDescriptorType = HID_DT_REPORT,
-    .wReportDescriptorLength = 23
+const static struct endpoint vdr_eps[] = {
+    { .dir = USB_DIR_IN, .type = EPT_INTERRUPT,
+      .mps = SAMISARA_TELEMETRY_REPORT_SZ+1,
+      .interval = 1 /* Telemetry is collected as soon as it is sent */,
+      .nr = &ep_telemetry }
 };
 
 const static uint8_t vdr_hid_report[] aligned(2) = {
@@ -207,29 +417,24 @@ const static uint8_t vdr_hid_report[] aligned(2) = {
     0x75, 0x08, /* Report Size (8) */
     0x95, SAMISARA_VINTF_REPORT_SZ, /* Report Count */
     0xb1, 0x02, /* Feature (Data, Array) */
+    0x09, 0xf1, /* Usage (Vendor) */
+    0x85, SAMISARA_TELEMETRY_REPORT_ID, /* Report ID */
+    0x95, SAMISARA_TELEMETRY_REPORT_SZ, /* Report Count */
+    0x81, 0x02, /* Input (Data, Variable, Absolute) */
     0xc0 /* End Collection */
 };
 
-unsigned int vdr_build_configuration_descriptor(uint8_t *dat)
-{
-    uint8_t *p = dat;
-    memcpy(p, &vdr_interface_descriptor, sizeof(vdr_interface_descriptor));
-    p += sizeof(vdr_interface_descriptor);
-    memcpy(p, &vdr_hid_descriptor, sizeof(vdr_hid_descriptor));
-    p += sizeof(vdr_hid_descriptor);
-    memcpy(p, &vdr_endpoint_descriptor, sizeof(vdr_endpoint_descriptor));
-    p += sizeof(vdr_endpoint_descriptor);
-    return p - dat;
-}
-
 const struct interface interface_vendor = {
     .name = "Vendor",
     .report_descriptor = vdr_hid_report,
     .report_descriptor_length = sizeof(vdr_hid_report),
-    .build_configuration_descriptor = vdr_build_configuration_descriptor,
+    .eps = vdr_eps,
+    .nr_eps = ARRAY_SIZE(vdr_eps),
     .initialise = vdr_initialise,
-    .handle_report = vdr_handle_report,
-    .handle_idle = vdr_handle_idle
+    .handle = {
+        [HID_REQ_REPORT] = vdr_handle_report,
+        [HID_REQ_IDLE] = vdr_handle_idle
+    }
 };
 
 /*
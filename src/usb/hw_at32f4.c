@@ -13,6 +13,43 @@
 
 static const struct usb_driver *drv;
 
+void IRQ_20(void) __attribute__((alias("IRQ_usb"))); /* usbd: USB_LP */
+void IRQ_67(void) __attribute__((alias("IRQ_usb"))); /* dwc_otg: OTG_FS */
+
+/* Re-enumeration: Detach once the current control transfer completes, and
+ * hold the detach (D+ driven low) long enough for the host to see it. */
+#define DETACH_MS 20
+static struct {
+    enum { RECONNECT_NONE, RECONNECT_PENDING, RECONNECT_DETACHED } state;
+    time_t deadline;
+    struct timer timer;
+} reconnect;
+
+/* Configured, and halted, IN endpoints. */
+static struct {
+    uint16_t configured;
+    uint16_t halted;
+} ep_in;
+
+/* Bus suspend, and remote wakeup. A device may signal resume only once the
+ * bus has been idle for 5ms, and must then drive it for 1-15ms. Suspend is
+ * detected after 3ms of idle. */
+#define WAKE_IDLE_MS   2  /* Beyond suspend detection */
+#define WAKE_SIGNAL_MS 5
+static struct {
+    bool_t suspended;
+    bool_t wake_enabled; /* DEVICE_REMOTE_WAKEUP feature */
+    enum { WAKE_NONE, WAKE_PENDING, WAKE_SIGNALLING } wake;
+    time_t time;         /* Start of suspend, or of resume signalling */
+    struct timer timer;  /* Next resume-signalling deadline */
+} bus;
+
+/* Timed USB work is done by usb_process(), in thread context. */
+static void usb_timer_fn(void *unused)
+{
+    work_post(WORK_USB);
+}
+
 void hw_usb_init(void)
 {
     switch (at32f4_series) {
@@ -38,10 +75,18 @@ void hw_usb_init(void)
     }
 
     drv->init();
+
+    timer_init(&reconnect.timer, usb_timer_fn, NULL);
+    timer_init(&bus.timer, usb_timer_fn, NULL);
+    IRQx_set_prio(drv->irq, USB_IRQ_PRI);
+    IRQx_enable(drv->irq);
 }
 
 void hw_usb_deinit(void)
 {
+    IRQx_disable(drv->irq);
+    IRQx_clear_pending(drv->irq);
+    timer_cancel(&bus.timer);
     drv->deinit();
 
     switch (at32f4_series) {
@@ -68,8 +113,15 @@ int ep_rx_ready(uint8_t epnr)
 
 bool_t ep_tx_ready(uint8_t epnr)
 {
+    if (ep_in.halted & (1u << epnr))
+        return FALSE;
     return drv->ep_tx_ready(epnr);
 }
+
+time_t ep_tx_time(uint8_t epnr)
+{
+    return drv->ep_tx_time(epnr);
+}
  
 void usb_read(uint8_t epnr, void *buf, uint32_t len)
 {
@@ -83,22 +135,200 @@ void usb_write(uint8_t epnr, const void *buf, uint32_t len)
  
 void usb_stall(uint8_t epnr)
 {
+    usb_log(SAMISARA_USBLOG_STALL, epnr, 0);
     drv->stall(epnr);
 }
 
 void usb_configure_ep(uint8_t epnr, uint8_t type, uint32_t size)
 {
+    if ((epnr & 0x80) && (epnr & 0x0f)) {
+        ep_in.configured |= 1u << (epnr & 0x0f);
+        ep_in.halted &= ~(1u << (epnr & 0x0f));
+    }
     drv->configure_ep(epnr, type, size);
 }
 
+void usb_deconfigure(void)
+{
+    ep_in.configured = ep_in.halted = 0;
+    drv->deconfigure();
+}
+
 void usb_setaddr(uint8_t addr)
 {
     drv->setaddr(addr);
 }
 
+void hw_set_remote_wakeup(bool_t enable)
+{
+    bus.wake_enabled = enable;
+}
+
+bool_t hw_remote_wakeup_enabled(void)
+{
+    return bus.wake_enabled;
+}
+
+static bool_t ep_in_valid(uint8_t ep)
+{
+    return (((ep & 0xf0) == 0x80)
+            && (ep_in.configured & (1u << (ep & 0x0f))));
+}
+
+bool_t hw_ep_set_halt(uint8_t ep, bool_t halt)
+{
+    uint16_t mask = 1u << (ep & 0x0f);
+
+    if (!ep_in_valid(ep))
+        return FALSE;
+
+    drv->halt(ep & 0x7f, halt);
+    if (halt) {
+        usb_log(SAMISARA_USBLOG_STALL, ep, 0);
+        ep_in.halted |= mask;
+    } else {
+        ep_in.halted &= ~mask;
+    }
+    return TRUE;
+}
+
+bool_t hw_ep_get_halt(uint8_t ep, bool_t *p_halt)
+{
+    if (!(ep & 0x7f)) {
+        *p_halt = FALSE;
+        return TRUE;
+    }
+
+    if (!ep_in_valid(ep))
+        return FALSE;
+
+    *p_halt = !!(ep_in.halted & (1u << (ep & 0x0f)));
+    return TRUE;
+}
+
+void handle_bus_reset(void)
+{
+    handle_resume();
+    usb_log(SAMISARA_USBLOG_RESET, 0, 0);
+    bus.wake_enabled = FALSE;
+    ep_in.configured = ep_in.halted = 0;
+    hid_bus_reset();
+}
+
+void handle_suspend(void)
+{
+    if (bus.suspended)
+        return;
+    bus.suspended = TRUE;
+    bus.wake = WAKE_NONE;
+    usb_log(SAMISARA_USBLOG_SUSPEND, 0, 0);
+    bus.time = time_now();
+    usb_class_ops.suspend();
+}
+
+void handle_resume(void)
+{
+    if (!bus.suspended)
+        return;
+    if (bus.wake == WAKE_SIGNALLING)
+        drv->resume_signal(FALSE);
+    bus.suspended = FALSE;
+    bus.wake = WAKE_NONE;
+    usb_log(SAMISARA_USBLOG_RESUME, 0, 0);
+    timer_cancel(&bus.timer);
+    usb_class_ops.resume();
+}
+
+bool_t usb_is_suspended(void)
+{
+    return bus.suspended;
+}
+
+bool_t usb_remote_wakeup(void)
+{
+    if (!bus.suspended || !bus.wake_enabled)
+        return FALSE;
+    if (bus.wake == WAKE_NONE) {
+        bus.wake = WAKE_PENDING;
+        timer_set(&bus.timer, time_add(bus.time, time_ms(WAKE_IDLE_MS)));
+    }
+    return TRUE;
+}
+
+static void wake_process(void)
+{
+    switch (bus.wake) {
+    case WAKE_PENDING:
+        if (time_since(bus.time) < time_ms(WAKE_IDLE_MS))
+            break;
+        usb_log(SAMISARA_USBLOG_WAKEUP, 0, 0);
+        drv->resume_signal(TRUE);
+        bus.time = time_now();
+        bus.wake = WAKE_SIGNALLING;
+        timer_set(&bus.timer, time_add(bus.time, time_ms(WAKE_SIGNAL_MS)));
+        break;
+    case WAKE_SIGNALLING:
+        if (time_since(bus.time) < time_ms(WAKE_SIGNAL_MS))
+            break;
+        /* The host takes over resume signalling, then resumes the bus.
+         * The controller need not report the wakeup: we initiated it. */
+        handle_resume();
+        break;
+    default:
+        break;
+    }
+}
+
+void usb_reconnect(void)
+{
+    reconnect.state = RECONNECT_PENDING;
+    reconnect.deadline = time_now() + time_ms(10);
+    timer_set(&reconnect.timer, reconnect.deadline);
+}
+
+/* Returns TRUE while detached, when there is no controller to service. */
+static bool_t reconnect_process(void)
+{
+    switch (reconnect.state) {
+    case RECONNECT_PENDING:
+        if (time_since(reconnect.deadline) < 0)
+            break;
+        usb_deinit();
+        /* Nothing may be sent while detached. */
+        usb_class_ops.reset();
+        gpio_configure_pin(gpioa, 12, GPO_pushpull(IOSPD_LOW, LOW));
+        reconnect.state = RECONNECT_DETACHED;
+        reconnect.deadline = time_now() + time_ms(DETACH_MS);
+        timer_set(&reconnect.timer, reconnect.deadline);
+        return TRUE;
+    case RECONNECT_DETACHED:
+        if (time_since(reconnect.deadline) < 0)
+            return TRUE;
+        gpio_configure_pin(gpioa, 12, GPI_floating);
+        reconnect.state = RECONNECT_NONE;
+        usb_init(); /* rebuilds the descriptors */
+        break;
+    default:
+        break;
+    }
+    return FALSE;
+}
+
+/* The controller IRQ is masked until usb_process() has run. It is raised
+ * again at once if further events are pending. */
+static void IRQ_usb(void)
+{
+    IRQx_disable(drv->irq);
+    work_post(WORK_USB);
+}
+
 void usb_process(void)
 {
+    if (reconnect_process())
+        return;
     drv->process();
+    wake_process();
+    IRQx_enable(drv->irq);
 }
 
 /*
@@ -11,6 +11,8 @@
 
 #include "hw_dwc_otg.h"
 
+#define OTG_IRQ 67
+
 int conf_iface;
 static bool_t is_hs;
 
@@ -25,6 +27,8 @@ static struct ep {
     struct rx_buf *rx;
     uint16_t rxc, rxp, rx_nr;
     bool_t rx_active, tx_ready;
+    uint16_t tx_len; /* Length of the most recent IN transfer */
+    time_t tx_time; /* Completion of the most recent IN transfer */
 } eps[conf_nr_ep];
 
 static bool_t dwc_otg_has_highspeed(void)
@@ -110,23 +114,33 @@ static void write_packet(const void *p, uint8_t epnr, int len)
         otg_dfifo[epnr].x[0] = *_p++;
 }
 
-static void fifos_init(void)
+/* F7 OTG: FS 1.25k FIFO RAM, HS 4k FIFO RAM. In 32-bit words. */
+#define FIFO_SZ (((conf_port == PORT_FS) ? 0x500 : 0x1000) >> 2)
+
+/* FIFO RAM is allocated upwards: The shared RX FIFO, then EP0's TX FIFO.
+ * Space from fifo_cfg is reallocated on each SET_CONFIGURATION, to the TX
+ * FIFOs of the configured IN endpoints. */
+static unsigned int fifo_end, fifo_cfg;
+
+static unsigned int fifo_alloc(uint32_t size)
 {
-    unsigned int i, base, tx_sz, rx_sz, fifo_sz;
+    unsigned int base = fifo_end;
+    /* TX FIFO depth: At least one packet, and no less than 16 words. */
+    fifo_end += max_t(unsigned int, (size + 3) / 4, 16);
+    ASSERT(fifo_end <= FIFO_SZ);
+    return base;
+}
 
-    /* F7 OTG: FS 1.25k FIFO RAM, HS 4k FIFO RAM. */
-    fifo_sz = ((conf_port == PORT_FS) ? 0x500 : 0x1000) >> 2;
-    rx_sz = fifo_sz / 2;
-    tx_sz = fifo_sz / (2 * conf_nr_ep);
+static void fifos_init(void)
+{
+    unsigned int base, rx_sz = FIFO_SZ / 2;
 
     otg->grxfsiz = rx_sz;
 
-    base = rx_sz;
-    otg->dieptxf0 = (tx_sz << 16) | base;
-    for (i = 1; i < conf_nr_ep; i++) {
-        base += tx_sz;
-        otg->dieptxf[i-1] = (tx_sz << 16) | base;
-    }
+    fifo_end = rx_sz;
+    base = fifo_alloc(EP0_MPS);
+    otg->dieptxf0 = ((fifo_end - base) << 16) | base;
+    fifo_cfg = fifo_end;
 }
 
 static void dwc_otg_init(void)
@@ -187,6 +201,8 @@ static void dwc_otg_init(void)
     }
     otg->gintsts = ~0;
     otg->gintmsk = (OTG_GINT_USBRST |
+                    OTG_GINT_USBSUSP |
+                    OTG_GINT_WKUPINT |
                     OTG_GINT_ENUMDNE |
                     OTG_GINT_IEPINT |
                     OTG_GINT_OEPINT |
@@ -194,6 +210,9 @@ static void dwc_otg_init(void)
 
     fifos_init();
 
+    /* Raise the OTG interrupt line on unmasked events. */
+    otg->gahbcfg |= OTG_GAHBCFG_GINTMSK;
+
     /* HAL_PCD_Start, USB_DevConnect */
     otgd->dctl &= ~OTG_DCTL_SDIS;
     delay_ms(3);
@@ -217,6 +236,11 @@ static bool_t dwc_otg_ep_tx_ready(uint8_t epnr)
     return eps[epnr].tx_ready;
 }
 
+static time_t dwc_otg_ep_tx_time(uint8_t epnr)
+{
+    return eps[epnr].tx_time;
+}
+
 static void dwc_otg_read(uint8_t epnr, void *buf, uint32_t len)
 {
     struct ep *ep = &eps[epnr];
@@ -236,6 +260,7 @@ static void dwc_otg_write(uint8_t epnr, const void *buf, uint32_t len)
     diep->ctl |= OTG_DIEPCTL_CNAK | OTG_DIEPCTL_EPENA;
     write_packet(buf, epnr, len);
     eps[epnr].tx_ready = FALSE;
+    eps[epnr].tx_len = len;
 }
 
 static void dwc_otg_stall(uint8_t epnr)
@@ -244,6 +269,19 @@ static void dwc_otg_stall(uint8_t epnr)
     otg_doep[epnr].ctl |= OTG_DOEPCTL_STALL;
 }
 
+static void dwc_otg_halt(uint8_t epnr, bool_t halt)
+{
+    OTG_DIEP diep = &otg_diep[epnr];
+    if (halt) {
+        diep->ctl |= OTG_DIEPCTL_STALL;
+    } else {
+        diep->ctl = (diep->ctl & ~OTG_DIEPCTL_STALL) | OTG_DIEPCTL_SD0PID;
+        /* A packet pending when the endpoint was halted is sent now. */
+        if (!(diep->ctl & OTG_DIEPCTL_EPENA))
+            eps[epnr].tx_ready = TRUE;
+    }
+}
+
 static void dwc_otg_configure_ep(uint8_t epnr, uint8_t type, uint32_t size)
 {
     int i;
@@ -259,6 +297,10 @@ static void dwc_otg_configure_ep(uint8_t epnr, uint8_t type, uint32_t size)
     if (in || (epnr == 0)) {
         otgd->daintmsk |= 1u << epnr;
         if (!(otg_diep[epnr].ctl & OTG_DIEPCTL_USBAEP)) {
+            if (epnr != 0) {
+                unsigned int base = fifo_alloc(size);
+                otg->dieptxf[epnr-1] = ((fifo_end - base) << 16) | base;
+            }
             otg_diep[epnr].ctl |= 
                 OTG_DIEPCTL_MPSIZ(size) |
                 OTG_DIEPCTL_EPTYP(type) |
@@ -302,26 +344,52 @@ static void dwc_otg_setaddr(uint8_t addr)
     otgd->dcfg = (otgd->dcfg & ~OTG_DCFG_DAD(0x7f)) | OTG_DCFG_DAD(addr);
 }
 
+static void ep_deactivate(int epnr)
+{
+    otg_diep[epnr].ctl &= ~(OTG_DIEPCTL_STALL |
+                            OTG_DIEPCTL_USBAEP |
+                            OTG_DIEPCTL_MPSIZ(0x7ff) |
+                            OTG_DIEPCTL_TXFNUM(0xf) |
+                            OTG_DIEPCTL_SD0PID |
+                            OTG_DIEPCTL_EPTYP(3));
+    otg_doep[epnr].ctl &= ~(OTG_DOEPCTL_STALL |
+                            OTG_DOEPCTL_USBAEP |
+                            OTG_DOEPCTL_MPSIZ(0x7ff) |
+                            OTG_DOEPCTL_SD0PID |
+                            OTG_DOEPCTL_EPTYP(3));
+}
+
+static void dwc_otg_deconfigure(void)
+{
+    int i;
+
+    for (i = 1; i < conf_nr_ep; i++) {
+        if (otg_diep[i].ctl & OTG_DIEPCTL_EPENA)
+            otg_diep[i].ctl |= OTG_DIEPCTL_SNAK | OTG_DIEPCTL_EPDIS;
+        if (otg_doep[i].ctl & OTG_DOEPCTL_EPENA)
+            otg_doep[i].ctl |= OTG_DOEPCTL_SNAK | OTG_DOEPCTL_EPDIS;
+        ep_deactivate(i);
+        otg->dieptxf[i-1] = 0;
+    }
+    flush_tx_fifo(0x10);
+    otgd->daintmsk = 0x10001u;
+
+    memset(&eps[1], 0, sizeof(eps) - sizeof(eps[0]));
+    fifo_end = fifo_cfg;
+}
+
 static void handle_reset(void)
 {
     int i;
 
+    otg_pcgcctl->pcgcctl &= ~(OTG_PCGCCTL_STPPCLK | OTG_PCGCCTL_GATEHCLK);
+    handle_bus_reset();
+
     /* Initialise core. */
     otgd->dctl &= ~OTG_DCTL_RWUSIG;
     flush_tx_fifo(0x10);
-    for (i = 0; i < conf_nr_ep; i++) {
-        otg_diep[i].ctl &= ~(OTG_DIEPCTL_STALL |
-                             OTG_DIEPCTL_USBAEP |
-                             OTG_DIEPCTL_MPSIZ(0x7ff) |
-                             OTG_DIEPCTL_TXFNUM(0xf) |
-                             OTG_DIEPCTL_SD0PID |
-                             OTG_DIEPCTL_EPTYP(3));
-        otg_doep[i].ctl &= ~(OTG_DOEPCTL_STALL |
-                             OTG_DOEPCTL_USBAEP |
-                             OTG_DOEPCTL_MPSIZ(0x7ff) |
-                             OTG_DOEPCTL_SD0PID |
-                             OTG_DOEPCTL_EPTYP(3));
-    }
+    for (i = 0; i < conf_nr_ep; i++)
+        ep_deactivate(i);
     otgd->daintmsk = 0x10001u;
     otgd->doepmsk |= (OTG_DOEPMSK_STUPM |
                       OTG_DOEPMSK_XFRCM |
@@ -364,6 +432,8 @@ static void handle_rx_transfer(void)
         rxp = RX_MASK(ep, rxp++);
         read_packet(ep->rx[rxp].data, bcnt);
         ep->rx[rxp].count = bcnt;
+        if (epnr != 0)
+            usb_log(SAMISARA_USBLOG_OUT, epnr, bcnt);
         break;
     default:
         break;
@@ -406,8 +476,11 @@ static void handle_iepint(uint8_t epnr)
     if (iepint & OTG_DIEPINT_XFRC) {
         otgd->diepempmsk &= ~(1 << epnr);
         eps[epnr].tx_ready = TRUE;
+        eps[epnr].tx_time = time_now();
         if (epnr == 0)
             handle_tx_ep0();
+        else
+            usb_log(SAMISARA_USBLOG_IN, USB_DIR_IN | epnr, eps[epnr].tx_len);
     }
 
     if (iepint & OTG_DIEPINT_TXFE) {
@@ -460,6 +533,31 @@ static void dwc_otg_process(void)
     if (gintsts & OTG_GINT_RXFLVL) {
         handle_rx_transfer();
     }
+
+    if (gintsts & OTG_GINT_WKUPINT) {
+        printk("[WKUP]\n");
+        otg_pcgcctl->pcgcctl &= ~(OTG_PCGCCTL_STPPCLK | OTG_PCGCCTL_GATEHCLK);
+        otg->gintsts = OTG_GINT_WKUPINT;
+        handle_resume();
+    }
+
+    if (gintsts & OTG_GINT_USBSUSP) {
+        printk("[USBSUSP]\n");
+        otg->gintsts = OTG_GINT_USBSUSP;
+        /* Stop the PHY clock. Resume is detected asynchronously. */
+        otg_pcgcctl->pcgcctl |= OTG_PCGCCTL_STPPCLK;
+        handle_suspend();
+    }
+}
+
+static void dwc_otg_resume_signal(bool_t on)
+{
+    if (on) {
+        otg_pcgcctl->pcgcctl &= ~(OTG_PCGCCTL_STPPCLK | OTG_PCGCCTL_GATEHCLK);
+        otgd->dctl |= OTG_DCTL_RWUSIG;
+    } else {
+        otgd->dctl &= ~OTG_DCTL_RWUSIG;
+    }
 }
 
 const struct usb_driver dwc_otg = {
@@ -473,11 +571,17 @@ const struct usb_driver dwc_otg = {
     .setaddr = dwc_otg_setaddr,
 
     .configure_ep = dwc_otg_configure_ep,
+    .deconfigure = dwc_otg_deconfigure,
     .ep_rx_ready = dwc_otg_ep_rx_ready,
     .ep_tx_ready = dwc_otg_ep_tx_ready,
+    .ep_tx_time = dwc_otg_ep_tx_time,
     .read = dwc_otg_read,
     .write = dwc_otg_write,
-    .stall = dwc_otg_stall
+    .stall = dwc_otg_stall,
+    .halt = dwc_otg_halt,
+    .resume_signal = dwc_otg_resume_signal,
+
+    .irq = OTG_IRQ
 };
 
 /*
@@ -113,6 +113,8 @@ struct otg_doep { /* B00.. */
 struct otg_pcgcctl {
     uint32_t pcgcctl;  /* E00: Power and clock gating control */
 };
+#define OTG_PCGCCTL_GATEHCLK (1u<< 1)
+#define OTG_PCGCCTL_STPPCLK  (1u<< 0)
 
 struct otg_dfifo { /* 1000.. */
     uint32_t x[0x1000/4];
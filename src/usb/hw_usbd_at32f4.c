@@ -15,8 +15,13 @@
 
 void IRQ_19(void) __attribute__((alias("IRQ_USB_HP")));
 #define USB_HP_IRQ 19
+#define USB_LP_IRQ 20
 
-static uint16_t buf_end;
+/* Packet memory (PMA) is allocated upwards from the buffer descriptor table.
+ * Space below buf_cfg belongs to EP0; the rest is reallocated on each
+ * SET_CONFIGURATION. */
+#define PMA_SZ 512
+static uint16_t buf_end, buf_cfg;
 static uint8_t pending_addr;
 
 /* Double-buffer endpoints: RX/TX buffer rings interfacing to USB IRQ. */
@@ -30,6 +35,7 @@ static struct buf {
 
 static struct ep {
     bool_t is_dblbuf;
+    time_t tx_time; /* Completion of the most recent IN transfer */
     union {
         struct {
             /* Normal (non-double-buffered) endpoints: We track which 
@@ -76,6 +82,10 @@ static void usbd_init(void)
     usb->cntr &= ~USB_CNTR_FRES;
     delay_us(10);
 
+    /* Raise USB_LP on the events handled by usbd_process(). */
+    usb->cntr |= (USB_CNTR_CTRM | USB_CNTR_RESETM |
+                  USB_CNTR_SUSPM | USB_CNTR_WKUPM);
+
     IRQx_set_prio(USB_HP_IRQ, USB_IRQ_PRI);
     IRQx_enable(USB_HP_IRQ);
 }
@@ -131,6 +141,11 @@ static bool_t usbd_ep_tx_ready(uint8_t epnr)
     return ep->std.tx_ready;
 }
 
+static time_t usbd_ep_tx_time(uint8_t epnr)
+{
+    return eps[epnr].tx_time;
+}
+
 static void usbd_read(uint8_t epnr, void *buf, uint32_t len)
 {
     unsigned int i, base;
@@ -216,6 +231,37 @@ static void usbd_stall(uint8_t ep)
     usb->epr[ep] = epr;
 }
 
+static void usbd_halt(uint8_t epnr, bool_t halt)
+{
+    uint16_t epr = usb->epr[epnr];
+    if (halt) {
+        usbd_stall(epnr);
+        return;
+    }
+    /* Set status STALL->NAK, and reset the data toggle to DATA0. A packet
+     * pending when the endpoint was halted is lost. */
+    epr &= 0x077f; /* preserve rw & t fields (except STAT_TX, DTOG_TX) */
+    epr |= 0x8080; /* preserve rc_w0 fields */
+    epr ^= USB_EPR_STAT_TX(USB_STAT_NAK); /* modify STAT_TX */
+    usb->epr[epnr] = epr;
+    eps[epnr].std.tx_ready = TRUE;
+}
+
+static uint16_t pma_alloc(uint32_t size)
+{
+    uint16_t addr = buf_end;
+    buf_end += (size + 1) & ~1;
+    ASSERT(buf_end <= PMA_SZ);
+    return addr;
+}
+
+/* COUNT_RX value for an OUT buffer of @size bytes, in 32-byte blocks. */
+static uint16_t count_rx(uint32_t size)
+{
+    ASSERT((size != 0) && !(size & 31));
+    return 0x8000 | ((size/32 - 1) << 10);
+}
+
 static void usbd_configure_ep(uint8_t epnr, uint8_t type, uint32_t size)
 {
     static const uint8_t types[] = {
@@ -243,9 +289,8 @@ static void usbd_configure_ep(uint8_t epnr, uint8_t type, uint32_t size)
         ASSERT(epnr != 0);
         type = EPT_BULK;
         new_epr |= USB_EPR_EP_KIND_DBL_BUF;
-        bd->addr_0 = buf_end;
-        bd->addr_1 = buf_end + size;
-        buf_end += 2*size;
+        bd->addr_0 = pma_alloc(size);
+        bd->addr_1 = pma_alloc(size);
         ep->is_dblbuf = TRUE;
         ep->db.bufc = ep->db.bufp = ep->db.tx_hw_slots = 0;
     }
@@ -265,8 +310,7 @@ static void usbd_configure_ep(uint8_t epnr, uint8_t type, uint32_t size)
             new_epr |= (old_epr & 0x0070) ^ USB_EPR_STAT_TX(USB_STAT_VALID);
             ep->db.kick = TRUE;
         } else {
-            bd->addr_tx = buf_end;
-            buf_end += size;
+            bd->addr_tx = pma_alloc(size);
             bd->count_tx = 0;
             /* TX: Clears data toggle and sets status to NAK. */
             new_epr |= (old_epr & 0x0070) ^ USB_EPR_STAT_TX(USB_STAT_NAK);
@@ -282,9 +326,8 @@ static void usbd_configure_ep(uint8_t epnr, uint8_t type, uint32_t size)
             new_epr |= (old_epr & 0x0040) ^ 0x0040;
             ep->db.kick = FALSE;
         } else {
-            bd->addr_rx = buf_end;
-            buf_end += size;
-            bd->count_rx = 0x8400; /* USB_FS_MPS = 64 bytes */
+            bd->addr_rx = pma_alloc(size);
+            bd->count_rx = count_rx(size);
             /* OUT Endpoint must wait for a packet from the Host. */
             ep->std.rx_ready = FALSE;
         }
@@ -296,6 +339,19 @@ static void usbd_configure_ep(uint8_t epnr, uint8_t type, uint32_t size)
     usb->epr[epnr] = new_epr;
 }
 
+static void usbd_deconfigure(void)
+{
+    unsigned int epnr;
+
+    /* Writing back the toggle fields clears them: STAT_{RX,TX} = DISABLED.
+     * Also clears CTR_{RX,TX}, and the endpoint address and type. */
+    for (epnr = 1; epnr < ARRAY_SIZE(eps); epnr++)
+        usb->epr[epnr] &= 0x7070;
+
+    memset(&eps[1], 0, sizeof(eps) - sizeof(eps[0]));
+    buf_end = buf_cfg;
+}
+
 static void usbd_setaddr(uint8_t addr)
 {
     pending_addr = addr;
@@ -303,6 +359,9 @@ static void usbd_setaddr(uint8_t addr)
 
 static void handle_reset(void)
 {
+    usb->cntr &= ~(USB_CNTR_LP_MODE | USB_CNTR_FSUSP | USB_CNTR_RESUME);
+    handle_bus_reset();
+
     /* Reinitialise class-specific subsystem. */
     usb_class_ops.reset();
 
@@ -315,8 +374,9 @@ static void handle_reset(void)
 
     /* Prepare for Enumeration: Set up Endpoint 0 at Address 0. */
     pending_addr = 0;
-    buf_end = 64;
+    buf_end = 64; /* Buffer descriptor table */
     usb_configure_ep(0, EPT_CONTROL, EP0_MPS);
+    buf_cfg = buf_end;
     usb->daddr = USB_DADDR_EF | USB_DADDR_ADD(0);
 }
 
@@ -343,6 +403,8 @@ static void handle_rx_transfer(uint8_t epnr)
     /* We only handle Control Transfers here (endpoint 0). */
     if (epnr == 0)
         handle_rx_ep0(!!(epr & USB_EPR_SETUP));
+    else
+        usb_log(SAMISARA_USBLOG_OUT, epnr, usb_bufd[epnr].count_rx & 0x3ff);
 }
 
 static void handle_tx_transfer(uint8_t epnr)
@@ -354,10 +416,14 @@ static void handle_tx_transfer(uint8_t epnr)
 
     clear_ctr(epnr, USB_EPR_CTR_TX);
     ep->std.tx_ready = TRUE;
+    ep->tx_time = time_now();
 
     /* We only handle Control Transfers here (endpoint 0). */
-    if (epnr != 0)
+    if (epnr != 0) {
+        usb_log(SAMISARA_USBLOG_IN, USB_DIR_IN | epnr,
+                usb_bufd[epnr].count_tx & 0x3ff);
         return;
+    }
 
     handle_tx_ep0();
 
@@ -372,7 +438,8 @@ static void handle_tx_transfer(uint8_t epnr)
 static void usbd_process(void)
 {
     uint16_t istr = usb->istr;
-    usb->istr = ~istr;
+    /* SUSP is cleared only once the transceiver is suspended (below). */
+    usb->istr = ~(istr & ~USB_ISTR_SUSP);
 
     if (istr & USB_ISTR_CTR) {
         uint8_t ep = USB_ISTR_GET_EP_ID(istr);
@@ -394,6 +461,18 @@ static void usbd_process(void)
 
     if (istr & USB_ISTR_WKUP) {
         printk("[WKUP]\n");
+        usb->cntr &= ~(USB_CNTR_LP_MODE | USB_CNTR_FSUSP);
+        handle_resume();
+    }
+
+    if (istr & USB_ISTR_SUSP) {
+        printk("[SUSP]\n");
+        /* Suspend the analog transceiver, acknowledge the event, then
+         * enter low-power mode. */
+        usb->cntr |= USB_CNTR_FSUSP;
+        usb->istr = ~USB_ISTR_SUSP;
+        usb->cntr |= USB_CNTR_LP_MODE;
+        handle_suspend();
     }
 
     if (istr & USB_ISTR_RESET) {
@@ -402,6 +481,16 @@ static void usbd_process(void)
     }
 }
 
+static void usbd_resume_signal(bool_t on)
+{
+    if (on) {
+        usb->cntr &= ~(USB_CNTR_LP_MODE | USB_CNTR_FSUSP);
+        usb->cntr |= USB_CNTR_RESUME;
+    } else {
+        usb->cntr &= ~USB_CNTR_RESUME;
+    }
+}
+
 static void handle_dblbuf_rx_transfer(uint8_t epnr)
 {
     struct ep *ep;
@@ -522,11 +611,17 @@ const struct usb_driver usbd = {
     .setaddr = usbd_setaddr,
 
     .configure_ep = usbd_configure_ep,
+    .deconfigure = usbd_deconfigure,
     .ep_rx_ready = usbd_ep_rx_ready,
     .ep_tx_ready = usbd_ep_tx_ready,
+    .ep_tx_time = usbd_ep_tx_time,
     .read = usbd_read,
     .write = usbd_write,
-    .stall = usbd_stall
+    .stall = usbd_stall,
+    .halt = usbd_halt,
+    .resume_signal = usbd_resume_signal,
+
+    .irq = USB_LP_IRQ
 };
 
 /*
@@ -0,0 +1,92 @@
+/*
+ * usblog.c
+ * 
+ * USB flight recorder: A ring of the most recent USB events, timestamped,
+ * for retrieval by the host via the vendor interface. Always enabled, so
+ * that enumeration problems can be diagnosed on production firmware.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Events are recorded only in thread context (usb_process() and control
+ * request handlers): no lock is needed. The oldest records are overwritten
+ * when the ring is full. */
+#define NR_RECORDS 64
+static struct {
+    struct samisara_usblog_rec ring[NR_RECORDS];
+    uint32_t prod; /* Free-running producer index */
+    bool_t frozen;
+} usblog;
+
+static struct samisara_usblog_rec *usb_log_rec(uint8_t type)
+{
+    struct samisara_usblog_rec *rec;
+
+    rec = &usblog.ring[usblog.prod++ & (NR_RECORDS-1)];
+    rec->time = time_now();
+    rec->type = type;
+    return rec;
+}
+
+void usb_log(uint8_t type, uint8_t ep, uint16_t len)
+{
+    struct samisara_usblog_rec *rec;
+
+    if (usblog.frozen)
+        return;
+
+    rec = usb_log_rec(type);
+    memset(rec->setup, 0, sizeof(rec->setup));
+    rec->ep = ep;
+    rec->len = len;
+}
+
+void usb_log_setup(const struct usb_device_request *req)
+{
+    struct samisara_usblog_rec *rec;
+
+    BUILD_BUG_ON(sizeof(*req) != sizeof(rec->setup));
+
+    if (usblog.frozen)
+        return;
+
+    rec = usb_log_rec(SAMISARA_USBLOG_SETUP);
+    memcpy(rec->setup, req, sizeof(rec->setup));
+}
+
+void usb_log_freeze(bool_t frozen)
+{
+    usblog.frozen = frozen;
+}
+
+void usb_log_get(uint16_t first, struct samisara_subreport_usblog *log)
+{
+    uint16_t prod = usblog.prod, avail;
+    unsigned int i;
+
+    /* Clamp to the records still in the ring. */
+    avail = min_t(uint32_t, usblog.prod, NR_RECORDS);
+    if ((uint16_t)(prod - first) > avail)
+        first = prod - avail;
+
+    log->prod = prod;
+    log->first = first;
+    log->nr = min_t(unsigned int, ARRAY_SIZE(log->rec),
+                    (uint16_t)(prod - first));
+    log->time_mhz = TIME_MHZ;
+    for (i = 0; i < log->nr; i++)
+        log->rec[i] = usblog.ring[(uint16_t)(first + i) & (NR_RECORDS-1)];
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -153,6 +153,18 @@ uint32_t udiv64(uint64_t dividend, uint32_t divisor)
     return q;
 }
 
+uint16_t crc16_ccitt(const void *buf, size_t len, uint16_t crc)
+{
+    const uint8_t *b = buf;
+    unsigned int i;
+    while (len--) {
+        crc ^= (uint16_t)*b++ << 8;
+        for (i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
 /*
  * Local variables:
  * mode: C